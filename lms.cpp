@@ -5,1064 +5,7438 @@
 #include <sstream>
 #include <algorithm>
 #include <iomanip>
+#include <cstdint>
+#include <cmath>
+#include <cctype>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <limits>
+#include <cstring>
+#include <csignal>
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <cstdio>
+#include <random>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 using namespace std;
 
-class FileManager
+class Isbn
 {
-private:
-    vector<vector<string>> fileData;
-
 public:
-    void loadFile(const string &filename)
+    // Parses an ISBN-10 or ISBN-13 (hyphens and spaces allowed), validates its
+    // check digit and packs it as the equivalent ISBN-13 number.
+    // Returns 0 when the text is not a valid ISBN.
+    static uint64_t pack(const string &text)
     {
-        ifstream file(filename);
-        fileData.clear();
-        if (file)
+        string digits;
+        for (char c : text)
         {
-            string line;
-            while (getline(file, line))
-            {
-                vector<string> row;
-                stringstream ss(line);
-                string field;
-                while (getline(ss, field, ','))
-                    row.push_back(field);
-                fileData.push_back(row);
-            }
+            if (isdigit((unsigned char)c) || c == 'X' || c == 'x')
+                digits += (char)toupper((unsigned char)c);
+            else if (c != '-' && c != ' ')
+                return 0;
         }
+
+        if (digits.size() == 10)
+            return packIsbn10(digits);
+        if (digits.size() == 13)
+            return packIsbn13(digits);
+        return 0;
+    }
+
+    static uint64_t require(const string &text)
+    {
+        uint64_t key = pack(text);
+        if (key == 0)
+            throw runtime_error("Invalid ISBN: " + text);
+        return key;
+    }
+
+    static string format(uint64_t key)
+    {
+        ostringstream out;
+        out << setw(13) << setfill('0') << key;
+        return out.str();
+    }
+
+    // Spreadsheets turn 13-digit numbers into values like "9.78032E+12",
+    // which loses the trailing digits and makes distinct books collide.
+    static bool isMangled(const string &text)
+    {
+        return text.find_first_of("eE") != string::npos && text.find('.') != string::npos;
     }
 
-    void saveFile(const string &filename)
+private:
+    static uint64_t packIsbn13(const string &digits)
     {
-        ofstream file(filename);
-        for (auto &row : fileData)
+        if (digits.find('X') != string::npos)
+            return 0;
+        if (digits.compare(0, 3, "978") != 0 && digits.compare(0, 3, "979") != 0)
+            return 0;
+
+        int sum = 0;
+        uint64_t key = 0;
+        for (size_t i = 0; i < 13; ++i)
         {
-            for (size_t i = 0; i < row.size(); ++i)
-            {
-                file << row[i];
-                if (i != row.size() - 1)
-                    file << ",";
-            }
-            file << "\n";
+            int d = digits[i] - '0';
+            sum += (i % 2 == 0) ? d : d * 3;
+            key = key * 10 + d;
         }
-        fileData.clear();
+        return sum % 10 == 0 ? key : 0;
     }
 
-    void appendRecord(const vector<string> &record, const string &filename)
+    static uint64_t packIsbn10(const string &digits)
     {
-        ofstream file(filename, ios::app);
-        for (size_t i = 0; i < record.size(); ++i)
+        int sum = 0;
+        for (size_t i = 0; i < 10; ++i)
         {
-            file << record[i];
-            if (i != record.size() - 1)
-                file << ",";
+            int d;
+            if (digits[i] == 'X')
+            {
+                if (i != 9)
+                    return 0;
+                d = 10;
+            }
+            else
+                d = digits[i] - '0';
+            sum += d * (10 - (int)i);
         }
-        file << "\n";
-    }
+        if (sum % 11 != 0)
+            return 0;
 
-    vector<vector<string>> &getData() { return fileData; }
+        // Re-prefix with 978 and recompute the ISBN-13 check digit
+        uint64_t key = 978;
+        int sum13 = 9 + 7 * 3 + 8;
+        for (size_t i = 0; i < 9; ++i)
+        {
+            int d = digits[i] - '0';
+            sum13 += ((i + 3) % 2 == 0) ? d : d * 3;
+            key = key * 10 + d;
+        }
+        return key * 10 + (10 - sum13 % 10) % 10;
+    }
 };
 
-class LibraryMember
+// Dates typed as dd/mm/yyyy. Every place that takes a date from a user
+// (rollup trends, loan history, query WHERE clauses) reads it here, so
+// they accept and reject the same text.
+class Dates
 {
-protected:
-    string memberId;
-    string memberName;
-    string memberPassword;
-    int memberType;
-
-    bool hasOverdueItems(int maxDays)
+public:
+    // Days since 1970-01-01 of a calendar date
+    static int civilDay(int y, int m, int d)
     {
-        FileManager fm;
-        fm.loadFile("transactions.csv");
-        time_t now = time(0);
+        y -= m <= 2;
+        int era = (y >= 0 ? y : y - 399) / 400;
+        int yoe = y - era * 400;
+        int doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+        int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return era * 146097 + doe - 719468;
+    }
 
-        for (auto &trans : fm.getData())
+    // One or two digit day and month, four digit year, a real calendar
+    // date from 1970 on and nothing after it
+    static void parse(const string &text, int &y, int &m, int &d)
+    {
+        size_t at = 0;
+        auto number = [&](size_t minDigits, size_t maxDigits, char end) -> int
         {
-            if (trans[0] == memberId)
-            {
-                time_t issueDate = stol(trans[4]);
-                int daysOverdue = (now - issueDate) / 86400;
-                if (daysOverdue > maxDays)
-                    return true;
-            }
-        }
-        return false;
+            size_t start = at;
+            int value = 0;
+            while (at < text.size() && isdigit((unsigned char)text[at]) && at - start < maxDigits)
+                value = value * 10 + (text[at++] - '0');
+            if (at - start < minDigits || (end ? at >= text.size() || text[at++] != end : at != text.size()))
+                throw runtime_error("Invalid date: " + text);
+            return value;
+        };
+        d = number(1, 2, '/');
+        m = number(1, 2, '/');
+        y = number(4, 4, 0);
+        static const int days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+        if (y < 1970 || m < 1 || m > 12 || d < 1 || d > days[m - 1] + (m == 2 && leap))
+            throw runtime_error("Invalid date: " + text);
     }
 
-public:
-    virtual void displayMainMenu() = 0;
-    virtual ~LibraryMember() = default;
+    // Days since 1970-01-01 of a dd/mm/yyyy date
+    static int day(const string &text)
+    {
+        int y, m, d;
+        parse(text, y, m, d);
+        return civilDay(y, m, d);
+    }
+
+    // Local midnight at the start of a dd/mm/yyyy date
+    static time_t startOf(const string &text)
+    {
+        tm date = {};
+        parse(text, date.tm_year, date.tm_mon, date.tm_mday);
+        date.tm_year -= 1900;
+        date.tm_mon -= 1;
+        date.tm_isdst = -1;
+        return mktime(&date);
+    }
 };
 
-class Student : public LibraryMember
+// The branch libraries of a sharded deployment, listed in branches.csv as
+// BranchID,Name,DataDirectory. Each branch keeps its books, loans,
+// reservations, books.bloom and loan archive in its own directory; members
+// and the process files (mutation log, checkpoint, audit log) stay in the
+// working directory and are shared. Without branches.csv there is one
+// branch whose files are in the working directory.
+class Branches
 {
-    const int MAX_BORROW = 3;
-    const int LOAN_DAYS = 15;
-    const float DAILY_FINE = 10.0;
-
 public:
-    Student(const string &id, const string &name, const string &pwd)
+    struct Branch
     {
-        memberId = id;
-        memberName = name;
-        memberPassword = pwd;
-        memberType = 1;
+        string id;
+        string name;
+        string dir;
+    };
+
+    static const vector<Branch> &all()
+    {
+        static const vector<Branch> branches = load();
+        return branches;
     }
 
-    void displayMainMenu() override
+    static size_t count() { return all().size(); }
+    static bool sharded() { return !all().front().id.empty(); }
+
+    // The branch whose desk this thread is serving. Kiosk sessions swap it
+    // in and out together with their coroutines.
+    static size_t &current()
     {
-        while (true)
-        {
-            cout << "\nStudent Portal - " << memberName << "\n"
-                 << "1. View Available Books\n"
-                 << "2. View Current Loans\n"
-                 << "3. Borrow Book\n"
-                 << "4. Return Book\n"
-                 << "5. Check Fines\n"
-                 << "6. Reserve Book\n"
-                 << "7. Logout\n"
-                 << "Choice: ";
+        static thread_local size_t branch = 0;
+        return branch;
+    }
 
-            int choice;
-            cin >> choice;
+    // Makes another branch current until the end of the scope
+    class Scope
+    {
+    public:
+        explicit Scope(size_t branch) : saved(current()) { current() = branch; }
+        ~Scope() { current() = saved; }
 
-            try
-            {
-                switch (choice)
-                {
-                case 1:
-                    showAvailableBooks();
-                    break;
-                case 2:
-                    showCurrentLoans();
-                    break;
-                case 3:
-                    borrowBook();
-                    break;
-                case 4:
-                    returnBook();
-                    break;
-                case 5:
-                    calculateFines();
-                    break;
-                case 6:
-                    reserveBook();
-                    break;
-                case 7:
-                    return;
-                default:
-                    throw runtime_error("Invalid choice");
-                }
-            }
-            catch (const exception &e)
-            {
-                cerr << "Error: " << e.what() << endl;
-            }
-        }
+    private:
+        size_t saved;
+    };
+
+    // Where a branch keeps a file. Shared files, and paths that already
+    // name a branch directory, are returned unchanged.
+    static string pathIn(size_t branch, const string &name)
+    {
+        const string &dir = all()[branch].dir;
+        bool local = name == "books.csv" || name == "transactions.csv" || name == "reservations.csv" ||
+                     name == "books.bloom" || name == "transactions.archive";
+        return dir.empty() || !local ? name : dir + "/" + name;
     }
 
-private:
-    void showAvailableBooks()
+    static string path(const string &name) { return pathIn(current(), name); }
+
+    // A branch file's path in every branch, in branch order
+    static vector<string> paths(const string &name)
     {
-        FileManager fm;
-        fm.loadFile("books.csv");
-        cout << "\nAvailable Books:\n";
-        int count = 1;
-        for (auto &book : fm.getData())
-        {
-            if (book[4] == "0")
-            {
-                cout << count++ << ". " << book[0]
-                     << " by " << book[1] << " (ISBN: " << book[2] << ")\n";
-            }
-        }
+        vector<string> all;
+        for (size_t b = 0; b < count(); ++b)
+            all.push_back(pathIn(b, name));
+        return all;
     }
 
-    void borrowBook()
+    // Every branch, the current one first
+    static vector<size_t> fromCurrent()
     {
-        if (hasOverdueItems(LOAN_DAYS))
-        {
-            cout << "You have overdue books. Return them first.\n";
-            return;
-        }
+        vector<size_t> order;
+        for (size_t i = 0; i < count(); ++i)
+            order.push_back((current() + i) % count());
+        return order;
+    }
 
-        FileManager fm;
-        fm.loadFile("transactions.csv");
-        int activeLoans = count_if(fm.getData().begin(), fm.getData().end(),
-                                   [this](const vector<string> &t)
-                                   { return t[0] == memberId && t[5] == "0"; });
+    // "[Name] " before lines that mix several branches; nothing when not sharded
+    static string tag(size_t branch)
+    {
+        return sharded() ? "[" + all()[branch].name + "] " : "";
+    }
 
-        if (activeLoans >= MAX_BORROW)
+    // Runs fn(branch) for every branch, each on its own thread with that
+    // branch current, and returns the results in branch order
+    template <typename Result, typename Fn>
+    static vector<Result> fanOut(Fn fn)
+    {
+        vector<Result> results(count());
+        if (count() == 1)
         {
-            cout << "Maximum borrowing limit reached!\n";
-            return;
+            Scope scope(0);
+            results[0] = fn(0);
+            return results;
         }
 
-        string isbn;
-        cout << "Enter ISBN: ";
-        cin >> isbn;
-
-        fm.loadFile("books.csv");
-        auto bookIt = find_if(fm.getData().begin(), fm.getData().end(),
-                              [&isbn](const vector<string> &b)
-                              { return b[2] == isbn && b[4] == "0"; });
-
-        if (bookIt != fm.getData().end())
+        vector<exception_ptr> errors(count());
+        vector<thread> threads;
+        for (size_t b = 0; b < count(); ++b)
         {
-            (*bookIt)[4] = "1";
-            fm.saveFile("books.csv");
-
-            time_t dueDate = time(0) + LOAN_DAYS * 86400;
-            vector<string> transaction = {
-                memberId,
-                (*bookIt)[0],
-                isbn,
-                to_string(time(0)),
-                to_string(dueDate),
-                "0"};
-            fm.appendRecord(transaction, "transactions.csv");
-            cout << "Book borrowed successfully!\n";
+            threads.push_back(thread([&, b]()
+                                     {
+                current() = b;
+                try
+                {
+                    results[b] = fn(b);
+                }
+                catch (...)
+                {
+                    errors[b] = current_exception();
+                } }));
         }
-        else
+        for (auto &worker : threads)
+            worker.join();
+        for (auto &error : errors)
         {
-            cout << "Book not available!\n";
+            if (error)
+                rethrow_exception(error);
         }
+        return results;
     }
 
-    void returnBook()
+private:
+    static vector<Branch> load()
     {
-        string isbn;
-        cout << "Enter ISBN to return: ";
-        cin >> isbn;
+        vector<Branch> branches;
+        ifstream file("branches.csv");
+        string line;
+        while (getline(file, line))
+        {
+            vector<string> row;
+            stringstream ss(line);
+            string field;
+            while (getline(ss, field, ','))
+                row.push_back(field);
+            if (row.size() < 3 || row[0].empty() || row[2].empty())
+                continue;
+            if (mkdir(row[2].c_str(), 0755) != 0 && errno != EEXIST)
+                throw runtime_error("Cannot create branch directory " + row[2]);
+            branches.push_back({row[0], row[1].empty() ? row[0] : row[1], row[2]});
+        }
+        if (branches.empty())
+            branches.push_back({"", "", ""});
+        return branches;
+    }
+};
 
-        FileManager fm;
-        fm.loadFile("transactions.csv");
-        bool found = false;
+// One committed, immutable version of a table. Rows are held in fixed-size
+// chunks; a new version copies only the chunks it changes and shares the
+// rest with the version it was made from. Each chunk carries the packed
+// ISBNs of its rows' third column, where books, loans and reservations keep
+// them, so only changed chunks are ever parsed again.
+class TableVersion : public enable_shared_from_this<TableVersion>
+{
+public:
+    typedef vector<vector<string>> Rows;
+    typedef vector<uint64_t> Keys;
+    static const size_t CHUNK_ROWS = 512;
+
+    size_t size() const { return rowCount; }
+
+    const vector<string> &row(size_t i) const { return (*chunks[i / CHUNK_ROWS])[i % CHUNK_ROWS]; }
+
+    // Packed ISBN of a row; 0 when its third column is not a valid ISBN
+    uint64_t isbnAt(size_t i) const { return (*keys[i / CHUNK_ROWS])[i % CHUNK_ROWS]; }
 
-        for (auto &trans : fm.getData())
+    // The packed ISBNs of a chunk; versions share them where the chunk is unchanged
+    size_t chunkCount() const { return keys.size(); }
+    const Keys *chunkKeys(size_t c) const { return c < keys.size() ? keys[c].get() : nullptr; }
+
+    // The version this one was derived from, while it is still alive
+    shared_ptr<const TableVersion> previous() const { return from.lock(); }
+
+    Rows rows() const
+    {
+        Rows out;
+        out.reserve(rowCount);
+        for (auto &chunk : chunks)
+            out.insert(out.end(), chunk->begin(), chunk->end());
+        return out;
+    }
+
+    // Builds the version holding rows, reusing the chunks of base that are unchanged
+    static shared_ptr<const TableVersion> fromRows(const Rows &rows, const TableVersion *base)
+    {
+        auto version = make_shared<TableVersion>();
+        version->rowCount = rows.size();
+        if (base)
+            version->from = base->shared_from_this();
+        for (size_t start = 0; start < rows.size(); start += CHUNK_ROWS)
         {
-            if (trans[0] == memberId && trans[2] == isbn && trans[5] == "0")
+            size_t end = min(rows.size(), start + CHUNK_ROWS);
+            size_t c = start / CHUNK_ROWS;
+            if (base && c < base->chunks.size() && base->chunks[c]->size() == end - start &&
+                equal(rows.begin() + start, rows.begin() + end, base->chunks[c]->begin()))
             {
-                trans[5] = "1";
-                found = true;
-                break;
+                version->chunks.push_back(base->chunks[c]);
+                version->keys.push_back(base->keys[c]);
             }
+            else
+                version->addChunk(make_shared<const Rows>(rows.begin() + start, rows.begin() + end));
         }
+        return version;
+    }
 
-        if (found)
+    // Builds a version from rows read fresh from disk, moving them into its chunks
+    static shared_ptr<const TableVersion> fromRows(Rows &&rows)
+    {
+        auto version = make_shared<TableVersion>();
+        version->rowCount = rows.size();
+        for (size_t start = 0; start < rows.size(); start += CHUNK_ROWS)
         {
-            fm.saveFile("transactions.csv");
-
-            fm.loadFile("books.csv");
-            for (auto &book : fm.getData())
-            {
-                if (book[2] == isbn)
-                    book[4] = "0";
-            }
-            fm.saveFile("books.csv");
+            size_t end = min(rows.size(), start + CHUNK_ROWS);
+            version->addChunk(make_shared<const Rows>(make_move_iterator(rows.begin() + start),
+                                                      make_move_iterator(rows.begin() + end)));
+        }
+        return version;
+    }
 
-            cout << "Book returned successfully!\n";
+    shared_ptr<const TableVersion> withAppended(const vector<string> &row) const
+    {
+        auto version = make_shared<TableVersion>(*this);
+        version->from = shared_from_this();
+        if (chunks.empty() || chunks.back()->size() == CHUNK_ROWS)
+        {
+            version->chunks.push_back(make_shared<const Rows>(1, row));
+            version->keys.push_back(make_shared<const Keys>(1, keyOf(row)));
         }
         else
         {
-            cout << "No active loan found for this book!\n";
+            auto last = make_shared<Rows>(*chunks.back());
+            last->push_back(row);
+            version->chunks.back() = last;
+            auto lastKeys = make_shared<Keys>(*keys.back());
+            lastKeys->push_back(keyOf(row));
+            version->keys.back() = lastKeys;
         }
+        version->rowCount++;
+        return version;
     }
 
-    void calculateFines()
+    shared_ptr<const TableVersion> withRow(size_t i, const vector<string> &row) const
     {
-        FileManager fm;
-        fm.loadFile("transactions.csv");
-        float total = 0.0;
+        auto version = make_shared<TableVersion>(*this);
+        version->from = shared_from_this();
+        auto chunk = make_shared<Rows>(*chunks[i / CHUNK_ROWS]);
+        (*chunk)[i % CHUNK_ROWS] = row;
+        version->chunks[i / CHUNK_ROWS] = chunk;
+        auto chunkKeys = make_shared<Keys>(*keys[i / CHUNK_ROWS]);
+        (*chunkKeys)[i % CHUNK_ROWS] = keyOf(row);
+        version->keys[i / CHUNK_ROWS] = chunkKeys;
+        return version;
+    }
 
-        for (auto &trans : fm.getData())
-        {
-            if (trans[0] == memberId && trans[5] == "0")
-            {
-                time_t dueDate = stol(trans[4]);
-                int daysOverdue = (time(0) - dueDate) / 86400;
-                if (daysOverdue > 0)
-                    total += daysOverdue * DAILY_FINE;
-            }
-        }
-        cout << "Outstanding fines: ₹" << fixed << setprecision(2) << total << "\n";
+    // Later rows shift down, so every chunk from the erased row on is rebuilt
+    shared_ptr<const TableVersion> withoutRow(size_t i) const
+    {
+        auto version = make_shared<TableVersion>();
+        version->from = shared_from_this();
+        size_t first = i / CHUNK_ROWS;
+        version->chunks.assign(chunks.begin(), chunks.begin() + first);
+        version->keys.assign(keys.begin(), keys.begin() + first);
+        version->rowCount = rowCount - 1;
+
+        Rows tail;
+        for (size_t r = first * CHUNK_ROWS; r < rowCount; ++r)
+            if (r != i)
+                tail.push_back(row(r));
+        for (size_t start = 0; start < tail.size(); start += CHUNK_ROWS)
+            version->addChunk(make_shared<const Rows>(tail.begin() + start,
+                                                      tail.begin() + min(tail.size(), start + CHUNK_ROWS)));
+        return version;
     }
 
-    void reserveBook()
+private:
+    size_t rowCount = 0;
+    vector<shared_ptr<const Rows>> chunks;
+    vector<shared_ptr<const Keys>> keys;
+    weak_ptr<const TableVersion> from;
+
+    static uint64_t keyOf(const vector<string> &row) { return row.size() > 2 ? Isbn::pack(row[2]) : 0; }
+
+    void addChunk(const shared_ptr<const Rows> &chunk)
     {
-        string isbn;
-        cout << "Enter ISBN to reserve: ";
-        cin >> isbn;
+        auto chunkKeys = make_shared<Keys>();
+        chunkKeys->reserve(chunk->size());
+        for (const auto &row : *chunk)
+            chunkKeys->push_back(keyOf(row));
+        chunks.push_back(chunk);
+        keys.push_back(chunkKeys);
+    }
+};
 
-        FileManager fm;
-        fm.loadFile("books.csv");
-        auto bookIt = find_if(fm.getData().begin(), fm.getData().end(),
-                              [&isbn](const vector<string> &b)
-                              {
-                                  return b[2] == isbn && b[4] == "0" && b[5] == "0";
-                              });
+// Rows of a table version by packed ISBN (the third column of books,
+// loans and reservations), in order. Keys are spread over shards, so the
+// index of a version derived from an indexed one copies only the shards
+// its changed rows fall in and shares the rest.
+struct IsbnIndex
+{
+    typedef unordered_map<uint64_t, vector<uint32_t>> Shard;
+    static const size_t SHARDS = 256;
 
-        if (bookIt != fm.getData().end())
-        {
-            (*bookIt)[5] = "1";
-            fm.saveFile("books.csv");
+    vector<shared_ptr<const Shard>> shards;
 
-            vector<string> reservation = {
-                memberId,
-                (*bookIt)[0],
-                isbn,
-                to_string(time(0))};
-            fm.appendRecord(reservation, "reservations.csv");
-            cout << "Book reserved successfully!\n";
+    explicit IsbnIndex(const TableVersion &table)
+    {
+        vector<shared_ptr<Shard>> building(SHARDS);
+        for (auto &shard : building)
+        {
+            shard = make_shared<Shard>();
+            shard->reserve(table.size() / SHARDS + 1);
         }
-        else
+        for (size_t i = 0; i < table.size(); ++i)
         {
-            cout << "Book not available for reservation!\n";
+            if (uint64_t key = table.isbnAt(i))
+                (*building[shardOf(key)])[key].push_back(i);
         }
+        shards.assign(building.begin(), building.end());
     }
 
-    void showCurrentLoans()
+    // The index of table, from the index of the version it was derived from:
+    // only rows of chunks whose keys it does not share are compared
+    IsbnIndex(const TableVersion &table, const TableVersion &base, const IsbnIndex &index) : shards(index.shards)
     {
-        FileManager fm;
-        fm.loadFile("transactions.csv");
-        cout << "\nCurrent Loans:\n";
-        for (auto &trans : fm.getData())
+        map<size_t, shared_ptr<Shard>> copies;
+        auto edit = [&](uint64_t key) -> vector<uint32_t> &
         {
-            if (trans[0] == memberId && trans[5] == "0")
+            size_t s = shardOf(key);
+            auto &copy = copies[s];
+            if (!copy)
             {
-                time_t dueDate = stol(trans[4]);
-                tm *dt = localtime(&dueDate);
-                cout << "- " << trans[1] << " (ISBN: " << trans[2]
-                     << ") Due: " << put_time(dt, "%d/%m/%Y") << "\n";
+                copy = make_shared<Shard>(*shards[s]);
+                shards[s] = copy;
+            }
+            return (*copy)[key];
+        };
+
+        size_t rows = max(table.size(), base.size());
+        for (size_t c = 0; c * TableVersion::CHUNK_ROWS < rows; ++c)
+        {
+            if (table.chunkKeys(c) && table.chunkKeys(c) == base.chunkKeys(c))
+                continue;
+            size_t end = min(rows, (c + 1) * TableVersion::CHUNK_ROWS);
+            for (size_t i = c * TableVersion::CHUNK_ROWS; i < end; ++i)
+            {
+                uint64_t was = i < base.size() ? base.isbnAt(i) : 0;
+                uint64_t now = i < table.size() ? table.isbnAt(i) : 0;
+                if (was == now)
+                    continue;
+                if (was)
+                {
+                    auto &list = edit(was);
+                    auto at = lower_bound(list.begin(), list.end(), (uint32_t)i);
+                    if (at != list.end() && *at == i)
+                        list.erase(at);
+                    if (list.empty())
+                        copies[shardOf(was)]->erase(was);
+                }
+                if (now)
+                {
+                    auto &list = edit(now);
+                    list.insert(lower_bound(list.begin(), list.end(), (uint32_t)i), (uint32_t)i);
+                }
             }
         }
     }
-};
-
-class Faculty : public LibraryMember
-{
-    const int MAX_BORROW = 10;
-    const int LOAN_DAYS = 60;
 
-public:
-    Faculty(const string &id, const string &name, const string &pwd)
+    const vector<uint32_t> &rowsOf(uint64_t key) const
+    {
+        static const vector<uint32_t> none;
+        const Shard &shard = *shards[shardOf(key)];
+        auto it = shard.find(key);
+        return it != shard.end() ? it->second : none;
+    }
+
+    static size_t shardOf(uint64_t key) { return (key * 0x9E3779B97F4A7C15ULL) >> 56; }
+};
+
+// How a column type is built for a table version. Types that can be
+// brought up to date from the columns of the version it was derived from
+// overload this.
+template <typename Columns>
+Columns *deriveColumns(const TableVersion &table, const TableVersion *, const Columns *)
+{
+    return new Columns(table);
+}
+
+// Removing a row near the top shifts every row after it, which costs more
+// to patch than to index afresh
+inline IsbnIndex *deriveColumns(const TableVersion &table, const TableVersion *base, const IsbnIndex *index)
+{
+    if (!base || !index)
+        return new IsbnIndex(table);
+    size_t changed = 0;
+    for (size_t c = 0; c < max(table.chunkCount(), base->chunkCount()); ++c)
+        changed += !table.chunkKeys(c) || table.chunkKeys(c) != base->chunkKeys(c);
+    if (changed > 4 && changed * 8 > table.chunkCount())
+        return new IsbnIndex(table);
+    return new IsbnIndex(table, *base, *index);
+}
+
+// Columns are derived once per committed table version and shared by every
+// reader of that version. Entries live as long as their version, so the
+// branches' tables do not evict each other. A version derived from one
+// whose columns are still cached is given them to start from. With build
+// false, columns not cached yet are not built.
+template <typename Columns>
+shared_ptr<const Columns> columnsOf(const shared_ptr<const TableVersion> &version, bool build = true)
+{
+    typedef pair<weak_ptr<const TableVersion>, shared_ptr<const Columns>> Entry;
+    static mutex m;
+    static map<const TableVersion *, Entry> cache;
+    lock_guard<mutex> lock(m);
+    for (auto it = cache.begin(); it != cache.end();)
+    {
+        if (it->second.first.expired())
+            it = cache.erase(it);
+        else
+            ++it;
+    }
+    auto found = cache.find(version.get());
+    if (found != cache.end() && found->second.second)
+        return found->second.second;
+    if (!build)
+        return nullptr;
+    auto base = version->previous();
+    auto derived = base ? cache.find(base.get()) : cache.end();
+    const Columns *from = derived != cache.end() ? derived->second.second.get() : nullptr;
+    Entry &entry = cache[version.get()];
+    entry = Entry(version, shared_ptr<const Columns>(deriveColumns(*version, base.get(), from)));
+    return entry.second;
+}
+
+// A consistent point-in-time view of every table. Holding one keeps its
+// versions alive while circulation goes on committing newer ones.
+struct Snapshot
+{
+    uint64_t epoch = 0;
+    map<string, shared_ptr<const TableVersion>> tables;
+
+    // A bare branch table name refers to the current branch's copy
+    shared_ptr<const TableVersion> table(const string &name) const
+    {
+        auto it = tables.find(Branches::path(name));
+        return it != tables.end() ? it->second : make_shared<TableVersion>();
+    }
+};
+
+// One entry of the mutation log that read replicas tail. Rows are shipped
+// in the same comma-separated form the CSV files use.
+struct LogRecord
+{
+    uint64_t seq = 0;
+    long long timestamp = 0;
+    string op;
+    string file;
+    size_t row = 0;
+    vector<string> fields;
+
+    string encode() const
+    {
+        ostringstream out;
+        out << seq << '\t' << timestamp << '\t' << op << '\t' << file << '\t' << row << '\t';
+        for (size_t i = 0; i < fields.size(); ++i)
+            out << (i ? "," : "") << fields[i];
+        return out.str();
+    }
+
+    static bool decode(const string &line, LogRecord &rec)
+    {
+        vector<string> parts;
+        stringstream ss(line);
+        string part;
+        while (parts.size() < 5 && getline(ss, part, '\t'))
+            parts.push_back(part);
+        if (parts.size() < 5 || parts[0].empty() || !isdigit((unsigned char)parts[0][0]))
+            return false;
+
+        try
+        {
+            rec.seq = stoull(parts[0]);
+            rec.timestamp = stoll(parts[1]);
+            rec.row = stoul(parts[4]);
+        }
+        catch (const exception &)
+        {
+            return false;
+        }
+        rec.op = parts[2];
+        rec.file = parts[3];
+        rec.fields.clear();
+        string field;
+        while (getline(ss, field, ','))
+            rec.fields.push_back(field);
+        return true;
+    }
+};
+
+// Append-only log of every change the primary makes to its tables:
+// RESET empties a table, APP appends a row, SET replaces one and DEL
+// removes one. COMMIT closes the records of one save. Each checkpoint
+// starts a new log whose first record, BASE, carries the sequence number
+// the checkpoint was taken at; the records before it are dropped.
+class MutationLog
+{
+private:
+    static ofstream &stream()
+    {
+        static ofstream log;
+        return log;
+    }
+
+    static string &path()
+    {
+        static string file;
+        return file;
+    }
+
+    static uint64_t &lastSeq()
+    {
+        static uint64_t seq = 0;
+        return seq;
+    }
+
+    static bool &uncommitted()
+    {
+        static bool flag = false;
+        return flag;
+    }
+
+public:
+    static long long nowMs()
+    {
+        return chrono::duration_cast<chrono::milliseconds>(
+                   chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static bool isOpen() { return stream().is_open(); }
+
+    // The last sequence number written and the byte offset just past it
+    static void position(uint64_t &seq, streamoff &offset)
+    {
+        seq = lastSeq();
+        offset = isOpen() ? (streamoff)stream().tellp() : 0;
+    }
+
+    static void open(const string &path)
+    {
+        MutationLog::path() = path;
+
+        // Continue numbering from the last complete record
+        ifstream existing(path);
+        if (existing)
+        {
+            existing.seekg(0, ios::end);
+            streamoff size = existing.tellg();
+            streamoff base = max<streamoff>(0, size - 4096);
+            existing.seekg(base);
+            string line;
+            LogRecord rec;
+            if (base > 0)
+                getline(existing, line); // starts mid-record
+            streamoff end = existing ? (streamoff)existing.tellg() : base;
+            while (getline(existing, line))
+            {
+                if (existing.eof())
+                    break;
+                end = existing.tellg();
+                if (LogRecord::decode(line, rec))
+                    lastSeq() = rec.seq;
+            }
+            // A record cut short by a crash would run into the next one
+            if (end < size && (base == 0 || end > base) && truncate(path.c_str(), end) != 0)
+                throw runtime_error("Cannot repair mutation log " + path);
+        }
+        stream().open(path, ios::app);
+        if (!stream())
+            throw runtime_error("Cannot open mutation log " + path);
+    }
+
+    static void append(const string &op, const string &file, size_t row, const vector<string> &fields)
+    {
+        if (!isOpen())
+            return;
+        LogRecord rec;
+        rec.seq = ++lastSeq();
+        rec.timestamp = nowMs();
+        rec.op = op;
+        rec.file = file;
+        rec.row = row;
+        rec.fields = fields;
+        stream() << rec.encode() << "\n";
+        uncommitted() = op != "COMMIT";
+    }
+
+    // Replaces the log with a BASE record for the checkpoint taken at seq
+    // base, followed by the records written after offset from. The caller
+    // keeps every writer out while this runs.
+    static void rotate(uint64_t base, streamoff from)
+    {
+        if (!isOpen())
+            return;
+        stream().flush();
+
+        string temp = path() + ".tmp";
+        {
+            ifstream in(path(), ios::binary);
+            in.seekg(from);
+            ofstream out(temp, ios::binary | ios::trunc);
+            LogRecord rec;
+            rec.seq = base;
+            rec.timestamp = nowMs();
+            rec.op = "BASE";
+            out << rec.encode() << "\n";
+            char buffer[65536];
+            while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0)
+                out.write(buffer, in.gcount());
+            if (!out.flush())
+                return; // the old log stays in place
+        }
+        stream().close();
+        if (rename(temp.c_str(), path().c_str()) != 0)
+            remove(temp.c_str());
+        stream().open(path(), ios::app);
+        if (!stream())
+            throw runtime_error("Cannot reopen mutation log " + path());
+    }
+
+    // Ends a group of records that replicas must apply together
+    static void commit()
+    {
+        if (!isOpen() || !uncommitted())
+            return;
+        append("COMMIT", "", 0, vector<string>());
+        stream().flush();
+    }
+
+    // Logs the row-level difference between two versions of a table. Saves
+    // in this program edit rows in place or remove them; anything else is
+    // shipped as a full reset.
+    static void appendDiff(const string &file, const TableVersion *before,
+                           const vector<vector<string>> &after)
+    {
+        if (!isOpen())
+            return;
+
+        if (before && before->size() == after.size())
+        {
+            for (size_t i = 0; i < after.size(); ++i)
+                if (before->row(i) != after[i])
+                    append("SET", file, i, after[i]);
+            return;
+        }
+        if (before && before->size() > after.size())
+        {
+            vector<size_t> removed;
+            size_t j = 0;
+            for (size_t i = 0; i < before->size(); ++i)
+            {
+                if (j < after.size() && before->row(i) == after[j])
+                    ++j;
+                else
+                    removed.push_back(j);
+            }
+            if (j == after.size())
+            {
+                for (size_t row : removed)
+                    append("DEL", file, row, vector<string>());
+                return;
+            }
+        }
+
+        append("RESET", file, 0, vector<string>());
+        for (size_t i = 0; i < after.size(); ++i)
+            append("APP", file, i, after[i]);
+    }
+};
+
+class FileManager
+{
+private:
+    typedef TableVersion::Rows Table;
+    typedef map<string, shared_ptr<const TableVersion>> VersionMap;
+
+    vector<vector<string>> fileData;
+    shared_ptr<const TableVersion> loaded;
+    shared_ptr<const Snapshot> pinned;
+
+    // The committed version of every table this process has read. All
+    // sessions share it; saves and appends write through to disk and then
+    // publish a new version under a new epoch.
+    static VersionMap &store()
+    {
+        static VersionMap tables;
+        return tables;
+    }
+
+    static uint64_t &epoch()
+    {
+        static uint64_t counter = 0;
+        return counter;
+    }
+
+    // Held only to read or swap version pointers, never while copying rows
+    static mutex &storeMutex()
+    {
+        static mutex m;
+        return m;
+    }
+
+    // Serializes writers, so each save is diffed against the version it replaces
+    static mutex &writeMutex()
+    {
+        static mutex m;
+        return m;
+    }
+
+    // Changes a replica has applied since the primary's last COMMIT
+    static VersionMap &pending()
+    {
+        static VersionMap tables;
+        return tables;
+    }
+
+    // Set on read replicas, whose tables come only from the primary's log
+    static bool &replicaMode()
+    {
+        static bool flag = false;
+        return flag;
+    }
+
+    static void publish(const VersionMap &versions)
+    {
+        // The ISBN index of a table in use follows it to the new version
+        // while the old one, and so its index, is still alive
+        for (auto &entry : versions)
+        {
+            auto base = entry.second->previous();
+            if (base && columnsOf<IsbnIndex>(base, false))
+                columnsOf<IsbnIndex>(entry.second);
+        }
+        lock_guard<mutex> lock(storeMutex());
+        for (auto &entry : versions)
+            store()[entry.first] = entry.second;
+        epoch()++;
+    }
+
+    static Table readFile(const string &filename)
+    {
+        Table rows;
+        ifstream file(filename);
+        if (file)
+        {
+            // Split in place rather than through a stringstream per line; as
+            // with getline, a trailing empty field is not a field
+            string line;
+            while (getline(file, line))
+            {
+                vector<string> row;
+                size_t begin = 0;
+                for (size_t comma; (comma = line.find(',', begin)) != string::npos; begin = comma + 1)
+                    row.emplace_back(line, begin, comma - begin);
+                if (begin < line.size())
+                    row.emplace_back(line, begin, string::npos);
+                rows.push_back(move(row));
+            }
+        }
+        return rows;
+    }
+
+    // The committed version of a table, read from disk on first use
+    static shared_ptr<const TableVersion> current(const string &filename)
+    {
+        {
+            lock_guard<mutex> lock(storeMutex());
+            auto it = store().find(filename);
+            if (it != store().end())
+                return it->second;
+        }
+        if (replicaMode())
+            return make_shared<TableVersion>();
+
+        auto version = TableVersion::fromRows(readFile(filename));
+        lock_guard<mutex> lock(storeMutex());
+        return store().insert(make_pair(filename, version)).first->second;
+    }
+
+public:
+    FileManager() {}
+
+    // Readers never see a half-written table: rows go to a temporary file
+    // that then replaces the original
+    static void writeFile(const string &filename, const Table &rows)
+    {
+        string temp = filename + ".tmp";
+        {
+            ofstream file(temp);
+            for (auto &row : rows)
+            {
+                for (size_t i = 0; i < row.size(); ++i)
+                {
+                    file << row[i];
+                    if (i != row.size() - 1)
+                        file << ",";
+                }
+                file << "\n";
+            }
+            if (!file)
+                throw runtime_error("Cannot write " + temp);
+        }
+        if (rename(temp.c_str(), filename.c_str()) != 0)
+            throw runtime_error("Cannot replace " + filename);
+    }
+
+    // A manager whose loads all read the given point-in-time view
+    explicit FileManager(shared_ptr<const Snapshot> snapshot) : pinned(snapshot) {}
+
+    // Every table file: users.csv, each branch's books, loans and
+    // reservations and, when sharded, the inter-branch loan ledger
+    static const vector<string> &tablePaths()
+    {
+        static const vector<string> paths = []()
+        {
+            vector<string> all = {"users.csv"};
+            for (size_t b = 0; b < Branches::count(); ++b)
+                for (const char *name : {"books.csv", "transactions.csv", "reservations.csv"})
+                    all.push_back(Branches::pathIn(b, name));
+            if (Branches::sharded())
+                all.push_back("interbranch.csv");
+            return all;
+        }();
+        return paths;
+    }
+
+    // Pins the current version of every table without copying any rows
+    static shared_ptr<const Snapshot> pin()
+    {
+        for (const string &name : tablePaths())
+            current(name);
+
+        auto snapshot = make_shared<Snapshot>();
+        lock_guard<mutex> lock(storeMutex());
+        snapshot->epoch = epoch();
+        snapshot->tables = store();
+        return snapshot;
+    }
+
+    static void enterReplicaMode() { replicaMode() = true; }
+
+    // Pins every table together with the log position it matches; no save
+    // can run in between
+    static shared_ptr<const Snapshot> pinAtLogPosition(uint64_t &seq, streamoff &offset)
+    {
+        lock_guard<mutex> lock(writeMutex());
+        MutationLog::position(seq, offset);
+        return pin();
+    }
+
+    // Replaces the committed tables, as when recovering from a checkpoint
+    // or a replica falls behind a new log
+    static void restore(const map<string, Table> &tables)
+    {
+        VersionMap versions;
+        for (auto &entry : tables)
+            versions[entry.first] = TableVersion::fromRows(entry.second, nullptr);
+        pending().clear();
+        publish(versions);
+    }
+
+    // Logs how each table differs from its rows in base, so replicas see
+    // edits made to the files while the program was stopped. A table
+    // missing from base is logged in full.
+    static void shipTables(const map<string, Table> &base)
+    {
+        lock_guard<mutex> lock(writeMutex());
+        for (const string &name : tablePaths())
+        {
+            Table rows = current(name)->rows();
+            auto it = base.find(name);
+            if (it == base.end())
+                MutationLog::appendDiff(name, nullptr, rows);
+            else if (it->second != rows)
+                MutationLog::appendDiff(name, TableVersion::fromRows(it->second, nullptr).get(), rows);
+        }
+        MutationLog::commit();
+    }
+
+    // Drops the log records a checkpoint at seq, offset has made redundant
+    static void rotateLog(uint64_t seq, streamoff offset)
+    {
+        lock_guard<mutex> lock(writeMutex());
+        MutationLog::rotate(seq, offset);
+    }
+
+    // Applies a record shipped from the primary. Changes become visible to
+    // readers together, when the primary's COMMIT for them arrives.
+    static void applyLogged(const LogRecord &rec)
+    {
+        if (rec.op == "COMMIT")
+        {
+            publish(pending());
+            pending().clear();
+            return;
+        }
+
+        auto &version = pending()[rec.file];
+        if (!version)
+            version = current(rec.file);
+
+        if (rec.op == "RESET")
+            version = make_shared<TableVersion>();
+        else if (rec.op == "APP")
+            version = version->withAppended(rec.fields);
+        else if (rec.op == "SET" && rec.row < version->size())
+            version = version->withRow(rec.row, rec.fields);
+        else if (rec.op == "DEL" && rec.row < version->size())
+            version = version->withoutRow(rec.row);
+    }
+
+    // Bare branch table names below refer to the current branch's copy
+    void loadFile(const string &name)
+    {
+        string filename = Branches::path(name);
+        loaded.reset();
+        if (pinned)
+        {
+            auto it = pinned->tables.find(filename);
+            if (it != pinned->tables.end())
+                loaded = it->second;
+        }
+        if (!loaded)
+            loaded = current(filename);
+        fileData = loaded->rows();
+    }
+
+    void saveFile(const string &name)
+    {
+        string filename = Branches::path(name);
+        if (replicaMode())
+            throw runtime_error("This is a read-only replica");
+        if (pinned)
+            throw runtime_error("Snapshot views are read-only");
+
+        lock_guard<mutex> lock(writeMutex());
+        auto base = current(filename);
+        // Rows loaded before another session's save would undo it
+        if (loaded && loaded != base)
+        {
+            fileData.clear();
+            loaded.reset();
+            throw runtime_error(name + " was changed by another session; nothing was saved");
+        }
+        auto next = TableVersion::fromRows(fileData, base.get());
+        MutationLog::appendDiff(filename, base.get(), fileData);
+        writeFile(filename, fileData);
+        publish(VersionMap{{filename, next}});
+        MutationLog::commit();
+
+        fileData.clear();
+        loaded.reset();
+    }
+
+    void appendRecord(const vector<string> &record, const string &name)
+    {
+        string filename = Branches::path(name);
+        if (replicaMode())
+            throw runtime_error("This is a read-only replica");
+
+        lock_guard<mutex> lock(writeMutex());
+        auto base = current(filename);
+        MutationLog::append("APP", filename, base->size(), record);
+
+        ofstream file(filename, ios::app);
+        for (size_t i = 0; i < record.size(); ++i)
+        {
+            file << record[i];
+            if (i != record.size() - 1)
+                file << ",";
+        }
+        file << "\n";
+        file.close();
+
+        publish(VersionMap{{filename, base->withAppended(record)}});
+        MutationLog::commit();
+    }
+
+    // Lookups by ISBN go through the index of the loaded version, kept up
+    // to date from the previous version's as saves commit new ones. Row
+    // numbers refer to the rows as loaded.
+    vector<size_t> findIsbn(uint64_t key) const
+    {
+        if (!loaded)
+            return vector<size_t>();
+        const vector<uint32_t> &rows = columnsOf<IsbnIndex>(loaded)->rowsOf(key);
+        return vector<size_t>(rows.begin(), rows.end());
+    }
+
+    uint64_t isbnAt(size_t row) const { return loaded && row < loaded->size() ? loaded->isbnAt(row) : 0; }
+
+    vector<vector<string>> &getData() { return fileData; }
+};
+
+// Checkpoints of every table together with the mutation log sequence
+// number they match, written to checkpoint.dat in the background from a
+// pinned snapshot. Each one then starts a new mutation log holding only
+// the records after it. While the program runs it holds an exclusive lock
+// on lms.pid; finding the file there but unlocked at startup means the last
+// run did not exit cleanly. Recovery then loads
+// the checkpoint and replays only the committed log records after it, so
+// restart time depends on the checkpoint interval, not on the log length.
+class Checkpoint
+{
+private:
+    static const char *path() { return "checkpoint.dat"; }
+    static const char *pidPath() { return "lms.pid"; }
+
+    struct Worker
+    {
+        thread loop;
+        atomic<bool> running;
+        uint64_t writtenSeq = 0;
+        int pidFile = -1;
+        Worker() : running(false) {}
+    };
+
+    static Worker &worker()
+    {
+        static Worker w;
+        return w;
+    }
+
+    // Committed records after the checkpoint, in groups that each end with
+    // a COMMIT. A group cut short by a crash is left out. The log holds
+    // little before them: it was rotated at this checkpoint or the one before.
+    static vector<LogRecord> logTail(const string &logPath, uint64_t seq)
+    {
+        vector<LogRecord> committed, group;
+        ifstream log(logPath);
+        if (!log)
+            return committed;
+
+        string line;
+        LogRecord rec;
+        while (getline(log, line) && !log.eof())
+        {
+            if (!LogRecord::decode(line, rec) || rec.seq <= seq)
+                continue;
+            group.push_back(rec);
+            if (rec.op == "COMMIT")
+            {
+                committed.insert(committed.end(), group.begin(), group.end());
+                group.clear();
+            }
+        }
+        return committed;
+    }
+
+public:
+    // Makes this process the primary of the data directory: the lock on
+    // lms.pid is held until exit, and the kernel drops it if the process
+    // dies. Throws if another process holds it. Returns whether the last
+    // primary left the file behind, that is, crashed.
+    static bool claim()
+    {
+        Worker &w = worker();
+        while (true)
+        {
+            struct stat before;
+            bool existed = stat(pidPath(), &before) == 0;
+            int fd = open(pidPath(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0)
+                throw runtime_error(string("Cannot open ") + pidPath() + ": " + strerror(errno));
+            if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+            {
+                int error = errno;
+                string pid;
+                ifstream(pidPath()) >> pid;
+                close(fd);
+                if (error == EWOULDBLOCK)
+                    throw runtime_error("Another instance" + (pid.empty() ? "" : " (pid " + pid + ")") +
+                                        " is running in this directory");
+                throw runtime_error(string("Cannot lock ") + pidPath() + ": " + strerror(error));
+            }
+
+            // A primary exiting cleanly removes the file before unlocking it;
+            // a lock taken on the removed file does not count
+            struct stat locked, current;
+            fstat(fd, &locked);
+            if (stat(pidPath(), &current) != 0 || current.st_ino != locked.st_ino)
+            {
+                close(fd);
+                continue;
+            }
+
+            string pid = to_string(getpid()) + "\n";
+            if (ftruncate(fd, 0) != 0 || write(fd, pid.data(), pid.size()) != (ssize_t)pid.size())
+            {
+                close(fd);
+                throw runtime_error(string("Cannot write ") + pidPath() + ": " + strerror(errno));
+            }
+            w.pidFile = fd;
+            return existed;
+        }
+    }
+
+    // Reads a checkpoint; false if it is missing or incomplete
+    static bool load(const string &file, map<string, TableVersion::Rows> &tables, uint64_t &seq)
+    {
+        ifstream in(file);
+        string line;
+        if (!getline(in, line))
+            return false;
+        istringstream header(line);
+        string tag;
+        if (!(header >> tag >> seq) || tag != "#checkpoint")
+            return false;
+
+        while (getline(in, line))
+        {
+            if (line == "#end")
+                return true;
+            istringstream table(line);
+            string name;
+            size_t rows;
+            if (!(table >> tag >> name >> rows) || tag != "#table")
+                return false;
+            auto &data = tables[name];
+            for (size_t i = 0; i < rows; ++i)
+            {
+                if (!getline(in, line))
+                    return false;
+                vector<string> row;
+                stringstream ss(line);
+                string field;
+                while (getline(ss, field, ','))
+                    row.push_back(field);
+                data.push_back(row);
+            }
+        }
+        return false;
+    }
+
+    // Rebuilds the tables from the checkpoint and the log tail, then
+    // rewrites the CSV files to match them; false without a checkpoint
+    static bool recover(const string &logPath)
+    {
+        auto start = chrono::steady_clock::now();
+        map<string, TableVersion::Rows> tables;
+        uint64_t seq;
+        if (!load(path(), tables, seq))
+        {
+            cerr << "No usable checkpoint; starting from the CSV files.\n";
+            return false;
+        }
+
+        FileManager::restore(tables);
+        vector<LogRecord> tail = logTail(logPath, seq);
+        for (auto &rec : tail)
+            FileManager::applyLogged(rec);
+        for (const string &name : FileManager::tablePaths())
+            FileManager::writeFile(name, FileManager::pin()->table(name)->rows());
+
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cerr << "Recovered from checkpoint at log record " << seq << " and " << tail.size()
+             << " later record(s) in " << fixed << setprecision(1) << ms << " ms.\n";
+        return true;
+    }
+
+    // Writes a checkpoint unless the log has not moved since the last one
+    static void take()
+    {
+        uint64_t seq;
+        streamoff offset;
+        auto snapshot = FileManager::pinAtLogPosition(seq, offset);
+        if (seq == worker().writtenSeq)
+            return;
+
+        string temp = string(path()) + ".tmp";
+        {
+            ofstream file(temp);
+            file << "#checkpoint " << seq << "\n";
+            for (const string &name : FileManager::tablePaths())
+            {
+                auto table = snapshot->table(name);
+                file << "#table " << name << " " << table->size() << "\n";
+                for (size_t i = 0; i < table->size(); ++i)
+                {
+                    const auto &row = table->row(i);
+                    for (size_t j = 0; j < row.size(); ++j)
+                        file << (j ? "," : "") << row[j];
+                    file << "\n";
+                }
+            }
+            file << "#end\n";
+            if (!file.flush())
+                return; // the previous checkpoint stays in place
+        }
+        int fd = ::open(temp.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            fsync(fd);
+            close(fd);
+        }
+        if (rename(temp.c_str(), path()) != 0)
+            return;
+        worker().writtenSeq = seq;
+        FileManager::rotateLog(seq, offset);
+    }
+
+    // Logs what changed in the CSV files since the checkpoint the last run
+    // ended with. Without a log, or a checkpoint matching its end, every
+    // table is logged in full.
+    static void shipChanges()
+    {
+        map<string, TableVersion::Rows> tables;
+        uint64_t seq = 0, last;
+        streamoff offset;
+        MutationLog::position(last, offset);
+        if (last == 0 || !load(path(), tables, seq) || seq != last)
+            tables.clear();
+        FileManager::shipTables(tables);
+    }
+
+    // Takes a checkpoint now and then every interval on a background thread
+    static void start(int intervalSeconds)
+    {
+        take();
+        Worker &w = worker();
+        w.running = true;
+        w.loop = thread([intervalSeconds]()
+                        {
+            auto next = chrono::steady_clock::now() + chrono::seconds(intervalSeconds);
+            while (worker().running)
+            {
+                this_thread::sleep_for(chrono::milliseconds(100));
+                if (chrono::steady_clock::now() < next)
+                    continue;
+                take();
+                next = chrono::steady_clock::now() + chrono::seconds(intervalSeconds);
+            } });
+    }
+
+    // A clean exit: a final checkpoint, and no recovery at the next start
+    static void stop()
+    {
+        Worker &w = worker();
+        if (!w.running)
+            return;
+        w.running = false;
+        w.loop.join();
+        take();
+        remove(pidPath());
+        close(w.pidFile);
+        w.pidFile = -1;
+    }
+};
+
+// Counting Bloom filter over 64-bit key hashes. Four-bit counters let keys
+// be removed as well as added; a zero counter on any probe proves absence.
+class CountingBloom
+{
+private:
+    static const int probes = 7;
+    vector<uint8_t> counters; // two counters per byte
+    uint64_t mask = 0;
+
+    int counter(uint64_t slot) const { return (counters[slot >> 1] >> ((slot & 1) * 4)) & 0xF; }
+
+    void setCounter(uint64_t slot, int value)
+    {
+        int shift = (slot & 1) * 4;
+        uint8_t &cell = counters[slot >> 1];
+        cell = (uint8_t)((cell & ~(0xF << shift)) | (value << shift));
+    }
+
+public:
+    uint64_t keys = 0;
+    uint64_t fingerprint = 0; // sum of the mixed key hashes, in any order
+
+    static uint64_t mix(uint64_t x)
+    {
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // Sized for about ten counters per key, for a false positive rate
+    // under one percent
+    void reset(uint64_t expectedKeys)
+    {
+        uint64_t slots = 1024;
+        while (slots < expectedKeys * 10)
+            slots <<= 1;
+        counters.assign(slots / 2, 0);
+        mask = slots - 1;
+        keys = 0;
+        fingerprint = 0;
+    }
+
+    bool crowded() const { return keys * 10 > mask + 1; }
+
+    void add(uint64_t hash)
+    {
+        uint64_t step = mix(hash) | 1;
+        for (int i = 0; i < probes; ++i)
+        {
+            uint64_t slot = (hash + i * step) & mask;
+            int count = counter(slot);
+            if (count < 15)
+                setCounter(slot, count + 1);
+        }
+        keys++;
+        fingerprint += mix(hash);
+    }
+
+    // A saturated counter has lost its true count, so it is never decremented
+    void remove(uint64_t hash)
+    {
+        uint64_t step = mix(hash) | 1;
+        for (int i = 0; i < probes; ++i)
+        {
+            uint64_t slot = (hash + i * step) & mask;
+            int count = counter(slot);
+            if (count > 0 && count < 15)
+                setCounter(slot, count - 1);
+        }
+        keys--;
+        fingerprint -= mix(hash);
+    }
+
+    bool mayContain(uint64_t hash) const
+    {
+        uint64_t step = mix(hash) | 1;
+        for (int i = 0; i < probes; ++i)
+        {
+            if (counter((hash + i * step) & mask) == 0)
+                return false;
+        }
+        return true;
+    }
+
+    bool save(const string &path) const
+    {
+        string temp = path + ".tmp";
+        {
+            ofstream file(temp, ios::binary);
+            uint64_t header[] = {keys, fingerprint, mask + 1};
+            file.write("LMSBLOOM", 8);
+            file.write((const char *)header, sizeof(header));
+            file.write((const char *)counters.data(), counters.size());
+            if (!file)
+                return false;
+        }
+        return rename(temp.c_str(), path.c_str()) == 0;
+    }
+
+    // Loads a saved filter only if it was built from exactly the given keys
+    bool load(const string &path, uint64_t expectedKeys, uint64_t expectedFingerprint)
+    {
+        ifstream file(path, ios::binary);
+        char magic[8];
+        uint64_t header[3];
+        if (!file.read(magic, 8) || memcmp(magic, "LMSBLOOM", 8) != 0 ||
+            !file.read((char *)header, sizeof(header)))
+            return false;
+        uint64_t slots = header[2];
+        if (header[0] != expectedKeys || header[1] != expectedFingerprint ||
+            slots < 2 || (slots & (slots - 1)) != 0 || slots > (1ULL << 40))
+            return false;
+
+        vector<uint8_t> loaded(slots / 2);
+        if (!file.read((char *)loaded.data(), loaded.size()))
+            return false;
+        counters.swap(loaded);
+        mask = slots - 1;
+        keys = header[0];
+        fingerprint = header[1];
+        return true;
+    }
+};
+
+// Fast-miss filters over the ISBNs in books.csv and the User IDs in
+// users.csv, saved beside them as books.bloom and users.bloom. A key the
+// filter has never seen is in no row, so the lookup fails without a scan.
+// Each branch has its own books filter, which also routes circulation to
+// the branches that may hold a book.
+class KeyFilters
+{
+private:
+    struct Filter
+    {
+        string table;
+        string path;
+        size_t column;
+        bool isbn;
+        bool ready = false;
+        CountingBloom bloom;
+        mutex guard;
+
+        Filter(const string &t, const string &p, size_t c, bool i) : table(t), path(p), column(c), isbn(i) {}
+    };
+
+    static Filter &books(size_t branch)
+    {
+        static vector<unique_ptr<Filter>> filters = []()
+        {
+            vector<unique_ptr<Filter>> all;
+            for (size_t b = 0; b < Branches::count(); ++b)
+                all.push_back(unique_ptr<Filter>(new Filter(Branches::pathIn(b, "books.csv"),
+                                                            Branches::pathIn(b, "books.bloom"), 2, true)));
+            return all;
+        }();
+        return *filters[branch];
+    }
+
+    static Filter &books() { return books(Branches::current()); }
+
+    static Filter &users()
+    {
+        static Filter filter("users.csv", "users.bloom", 1, false);
+        return filter;
+    }
+
+public:
+    static uint64_t userHash(const string &id)
+    {
+        uint64_t h = 1469598103934665603ULL;
+        for (char c : id)
+            h = (h ^ (unsigned char)c) * 1099511628211ULL;
+        return CountingBloom::mix(h);
+    }
+
+private:
+    static uint64_t isbnHash(uint64_t key) { return CountingBloom::mix(key); }
+
+    // Hashes of the key column of every committed row; rows with no usable
+    // key are left out, as no lookup can find them either
+    static vector<uint64_t> tableHashes(const Filter &f)
+    {
+        FileManager fm;
+        fm.loadFile(f.table);
+        vector<uint64_t> hashes;
+        hashes.reserve(fm.getData().size());
+        for (auto &row : fm.getData())
+        {
+            if (f.column >= row.size())
+                continue;
+            if (!f.isbn)
+                hashes.push_back(userHash(row[f.column]));
+            else if (uint64_t key = Isbn::pack(row[f.column]))
+                hashes.push_back(isbnHash(key));
+        }
+        return hashes;
+    }
+
+    static void rebuild(Filter &f, const vector<uint64_t> &hashes)
+    {
+        f.bloom.reset(hashes.size());
+        for (uint64_t h : hashes)
+            f.bloom.add(h);
+        // A file that fails to save is just rebuilt at the next open
+        f.bloom.save(f.path);
+    }
+
+    // The saved filter is trusted only if it covers the same keys as the
+    // table, which also catches edits made to the CSV by hand
+    static void open(Filter &f)
+    {
+        lock_guard<mutex> lock(f.guard);
+        vector<uint64_t> hashes = tableHashes(f);
+        uint64_t fingerprint = 0;
+        for (uint64_t h : hashes)
+            fingerprint += CountingBloom::mix(h);
+        if (!f.bloom.load(f.path, hashes.size(), fingerprint))
+            rebuild(f, hashes);
+        f.ready = true;
+    }
+
+    static bool mayContain(Filter &f, uint64_t hash)
+    {
+        lock_guard<mutex> lock(f.guard);
+        return !f.ready || f.bloom.mayContain(hash);
+    }
+
+    // Called once the table change is committed
+    static void change(Filter &f, uint64_t hash, size_t count, bool added)
+    {
+        lock_guard<mutex> lock(f.guard);
+        if (!f.ready)
+            return;
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (added)
+                f.bloom.add(hash);
+            else
+                f.bloom.remove(hash);
+        }
+        if (f.bloom.crowded())
+            rebuild(f, tableHashes(f));
+        else
+            f.bloom.save(f.path);
+    }
+
+public:
+    static void open()
+    {
+        for (size_t b = 0; b < Branches::count(); ++b)
+            open(books(b));
+        open(users());
+    }
+
+    static bool mayHaveIsbn(uint64_t key) { return mayContain(books(), isbnHash(key)); }
+
+    // Branches that may hold the book, the current one first
+    static vector<size_t> branchesWithIsbn(uint64_t key)
+    {
+        vector<size_t> branches;
+        for (size_t b : Branches::fromCurrent())
+        {
+            if (mayContain(books(b), isbnHash(key)))
+                branches.push_back(b);
+        }
+        return branches;
+    }
+    static bool mayHaveUser(const string &id) { return mayContain(users(), userHash(id)); }
+
+    static void addIsbn(uint64_t key) { change(books(), isbnHash(key), 1, true); }
+    static void removeIsbn(uint64_t key, size_t rows) { change(books(), isbnHash(key), rows, false); }
+    static void addUser(const string &id) { change(users(), userHash(id), 1, true); }
+    static void removeUser(const string &id, size_t rows) { change(users(), userHash(id), rows, false); }
+};
+
+// Audit trail of circulation and catalogue changes: who did what, to what
+// and when. Operations push fixed-size records into a lock-free ring with
+// many producers and one consumer, and never wait on disk; a background
+// writer appends them in batches to audit.log, one CRC-32 checked line per
+// record, and rotates the file as it grows. A push to a full ring is
+// dropped and counted; pushes that find it three quarters full count as
+// backpressure.
+class AuditLog
+{
+public:
+    struct Record
+    {
+        uint64_t seq;
+        int64_t timeMs;
+        char actor[24];
+        char action[16];
+        char subject[32];
+        char detail[56];
+    };
+
+    struct Stats
+    {
+        uint64_t written;
+        uint64_t dropped;
+        uint64_t backpressure;
+        size_t queued;
+    };
+
+private:
+    static const size_t capacity = 4096;
+    static const uint64_t rotateBytes = 4 << 20;
+    static const int keepFiles = 4;
+
+    struct Slot
+    {
+        atomic<size_t> turn;
+        Record record;
+    };
+
+    struct Ring
+    {
+        Slot slots[capacity];
+        atomic<size_t> head;
+        atomic<size_t> tail;
+        atomic<uint64_t> seq;
+        atomic<uint64_t> written;
+        atomic<uint64_t> dropped;
+        atomic<uint64_t> backpressure;
+        atomic<bool> running;
+        thread writer;
+
+        Ring() : head(0), tail(0), seq(0), written(0), dropped(0), backpressure(0), running(false)
+        {
+            for (size_t i = 0; i < capacity; ++i)
+                slots[i].turn.store(i, memory_order_relaxed);
+        }
+    };
+
+    static Ring &ring()
+    {
+        static Ring r;
+        return r;
+    }
+
+    static void copyField(char *out, size_t size, const string &value)
+    {
+        size_t n = min(size - 1, value.size());
+        for (size_t i = 0; i < n; ++i)
+            out[i] = value[i] == '\t' || value[i] == '\n' ? ' ' : value[i];
+        out[n] = '\0';
+    }
+
+    // Only the writer thread takes records out
+    static bool pop(Record &out)
+    {
+        Ring &r = ring();
+        size_t pos = r.tail.load(memory_order_relaxed);
+        Slot &slot = r.slots[pos % capacity];
+        if (slot.turn.load(memory_order_acquire) != pos + 1)
+            return false;
+        out = slot.record;
+        slot.turn.store(pos + capacity, memory_order_release);
+        r.tail.store(pos + 1, memory_order_relaxed);
+        return true;
+    }
+
+    static void rotate()
+    {
+        for (int i = keepFiles - 1; i >= 1; --i)
+            rename(("audit.log." + to_string(i)).c_str(), ("audit.log." + to_string(i + 1)).c_str());
+        rename("audit.log", "audit.log.1");
+    }
+
+    static uint64_t drain(ofstream &file)
+    {
+        Record rec;
+        uint64_t batch = 0;
+        while (batch < capacity && pop(rec))
+        {
+            file << encode(rec) << "\n";
+            batch++;
+        }
+        if (batch == 0)
+            return 0;
+        file.flush();
+        ring().written += batch;
+        if ((uint64_t)file.tellp() >= rotateBytes)
+        {
+            file.close();
+            rotate();
+            file.open("audit.log", ios::app);
+        }
+        return batch;
+    }
+
+public:
+    static uint32_t crc32(const string &data)
+    {
+        static uint32_t table[256];
+        static once_flag built;
+        call_once(built, []()
+                  {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                table[i] = c;
+            } });
+        uint32_t crc = 0xFFFFFFFFu;
+        for (unsigned char c : data)
+            crc = table[(crc ^ c) & 0xFF] ^ (crc >> 8);
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    // seq, time, actor, action, subject, detail, then the CRC-32 of the rest
+    static string encode(const Record &rec)
+    {
+        ostringstream line;
+        line << rec.seq << '\t' << rec.timeMs << '\t' << rec.actor << '\t' << rec.action << '\t'
+             << rec.subject << '\t' << rec.detail;
+        string text = line.str();
+        ostringstream crc;
+        crc << hex << setw(8) << setfill('0') << crc32(text);
+        return text + '\t' + crc.str();
+    }
+
+    // Never blocks: false if the ring was full and the record was dropped
+    static bool record(const string &actor, const string &action, const string &subject, const string &detail = "")
+    {
+        Ring &r = ring();
+        size_t pos = r.head.load(memory_order_relaxed);
+        Slot *slot;
+        while (true)
+        {
+            slot = &r.slots[pos % capacity];
+            size_t turn = slot->turn.load(memory_order_acquire);
+            if (turn == pos)
+            {
+                if (r.head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                    break;
+            }
+            else if (turn < pos)
+            {
+                r.dropped++;
+                return false;
+            }
+            else
+                pos = r.head.load(memory_order_relaxed);
+        }
+
+        Record &rec = slot->record;
+        rec.seq = ++r.seq;
+        rec.timeMs = MutationLog::nowMs();
+        copyField(rec.actor, sizeof(rec.actor), actor);
+        copyField(rec.action, sizeof(rec.action), action);
+        copyField(rec.subject, sizeof(rec.subject), subject);
+        copyField(rec.detail, sizeof(rec.detail), detail);
+        slot->turn.store(pos + 1, memory_order_release);
+
+        size_t tail = r.tail.load(memory_order_relaxed);
+        if (tail <= pos && pos - tail >= capacity * 3 / 4)
+            r.backpressure++;
+        return true;
+    }
+
+    static void start()
+    {
+        Ring &r = ring();
+        r.running = true;
+        r.writer = thread([]()
+                          {
+            ofstream file("audit.log", ios::app);
+            while (ring().running)
+            {
+                if (drain(file) == 0)
+                    this_thread::sleep_for(chrono::milliseconds(20));
+            }
+            drain(file); });
+    }
+
+    static void stop()
+    {
+        Ring &r = ring();
+        if (!r.running)
+            return;
+        r.running = false;
+        r.writer.join();
+    }
+
+    static Stats stats()
+    {
+        Ring &r = ring();
+        return {r.written, r.dropped, r.backpressure, r.head.load() - r.tail.load()};
+    }
+
+    // Checks every line of the current and rotated files against its CRC
+    static void verify()
+    {
+        uint64_t good = 0, bad = 0;
+        for (int i = 0; i <= keepFiles; ++i)
+        {
+            string name = i == 0 ? "audit.log" : "audit.log." + to_string(i);
+            ifstream file(name);
+            string line;
+            while (getline(file, line))
+            {
+                size_t tab = line.rfind('\t');
+                bool ok = tab != string::npos && line.size() - tab == 9;
+                if (ok)
+                {
+                    ostringstream crc;
+                    crc << hex << setw(8) << setfill('0') << crc32(line.substr(0, tab));
+                    ok = crc.str() == line.substr(tab + 1);
+                }
+                if (ok)
+                    good++;
+                else
+                {
+                    bad++;
+                    cout << name << ": bad record: " << line.substr(0, 60) << "\n";
+                }
+            }
+        }
+        cout << good << " audit record(s) verified, " << bad << " corrupt\n";
+    }
+
+    static void showStatus()
+    {
+        Stats s = stats();
+        cout << "\n=== Audit Log ===\n"
+             << "Written: " << s.written << "\n"
+             << "Queued: " << s.queued << " of " << capacity << "\n"
+             << "Dropped (ring full): " << s.dropped << "\n"
+             << "Backpressure events: " << s.backpressure << "\n";
+    }
+};
+
+struct LoanPolicy
+{
+    int maxBorrow;
+    int loanDays;
+    float dailyFine;
+    bool blockWhenOverdue;
+    int graceDays;
+    float fineCap;      // 0 means no cap
+    int blockAfterDays; // whole days a loan may be overdue before it blocks borrowing
+
+    float fineFor(time_t dueDate, time_t now) const
+    {
+        long chargeable = (now - dueDate) / 86400 - graceDays;
+        if (chargeable <= 0)
+            return 0.0f;
+        float fine = chargeable * dailyFine;
+        return fineCap > 0 ? min(fine, fineCap) : fine;
+    }
+
+    static const LoanPolicy &forType(int memberType)
+    {
+        static const map<int, LoanPolicy> policies = load();
+        auto it = policies.find(memberType);
+        if (it == policies.end())
+            throw runtime_error("No loan policy for member type " + to_string(memberType));
+        return it->second;
+    }
+
+private:
+    // Built-in policies, overridden by rows of loan_policy.csv:
+    // Type,MaxBorrow,LoanDays,DailyFine,GraceDays,FineCap,BlockWhenOverdue[,BlockAfterDays]
+    // A row without BlockAfterDays keeps the built-in value for its type.
+    static map<int, LoanPolicy> load()
+    {
+        map<int, LoanPolicy> policies;
+        policies[1] = {3, 15, 10.0f, true, 0, 0.0f, 15};
+        policies[2] = {10, 60, 10.0f, false, 0, 0.0f, 0};
+
+        ifstream file("loan_policy.csv");
+        string line;
+        while (getline(file, line))
+        {
+            vector<string> row;
+            stringstream ss(line);
+            string field;
+            while (getline(ss, field, ','))
+                row.push_back(field);
+            if (row.size() < 7)
+                continue;
+            int type = stoi(row[0]);
+            int blockAfterDays = row.size() > 7           ? stoi(row[7])
+                                 : policies.count(type) ? policies[type].blockAfterDays
+                                                        : 0;
+            policies[type] = {stoi(row[1]), stoi(row[2]), stof(row[3]), row[6] == "1",
+                              stoi(row[4]), stof(row[5]), blockAfterDays};
+        }
+        return policies;
+    }
+};
+
+struct MemberLoanSummary
+{
+    int activeCount = 0;
+    time_t earliestDue = 0;
+    float accruedFines = 0.0f;
+    multiset<time_t> dueDates;
+};
+
+class LoanPolicyEngine
+{
+private:
+    static unordered_map<string, MemberLoanSummary> &summaries()
+    {
+        static unordered_map<string, MemberLoanSummary> cache;
+        return cache;
+    }
+
+    static bool &loaded()
+    {
+        static bool flag = false;
+        return flag;
+    }
+
+    // Builds every member's summary in a single pass over each branch's
+    // transactions.csv, so limits apply across branches
+    static void load()
+    {
+        FileManager fm;
+        summaries().clear();
+        for (size_t b = 0; b < Branches::count(); ++b)
+        {
+            fm.loadFile(Branches::pathIn(b, "transactions.csv"));
+            for (auto &trans : fm.getData())
+            {
+                if (trans.size() > 5 && trans[5] == "0")
+                    summaries()[trans[0]].dueDates.insert(stol(trans[4]));
+            }
+        }
+        for (auto &entry : summaries())
+            refresh(entry.second);
+        loaded() = true;
+    }
+
+    static void refresh(MemberLoanSummary &summary)
+    {
+        summary.activeCount = summary.dueDates.size();
+        summary.earliestDue = summary.dueDates.empty() ? 0 : *summary.dueDates.begin();
+    }
+
+public:
+    static MemberLoanSummary &summary(const string &memberId, const LoanPolicy &policy, time_t now)
+    {
+        if (!loaded())
+            load();
+        MemberLoanSummary &s = summaries()[memberId];
+        s.accruedFines = 0.0f;
+        for (time_t due : s.dueDates)
+        {
+            if (due >= now)
+                break;
+            s.accruedFines += policy.fineFor(due, now);
+        }
+        return s;
+    }
+
+    // Returns an empty string when the member may borrow, otherwise the reason
+    static string checkBorrow(const string &memberId, const LoanPolicy &policy, time_t now)
+    {
+        const MemberLoanSummary &s = summary(memberId, policy, now);
+        if (policy.blockWhenOverdue && s.activeCount > 0 && (now - s.earliestDue) / 86400 > policy.blockAfterDays)
+            return "You have overdue books. Return them first.";
+        if (s.activeCount >= policy.maxBorrow)
+            return "Maximum borrowing limit reached!";
+        return "";
+    }
+
+    static void recordBorrow(const string &memberId, time_t dueDate)
+    {
+        if (!loaded())
+            return;
+        MemberLoanSummary &s = summaries()[memberId];
+        s.dueDates.insert(dueDate);
+        refresh(s);
+    }
+
+    static void recordReturn(const string &memberId, time_t dueDate)
+    {
+        if (!loaded())
+            return;
+        MemberLoanSummary &s = summaries()[memberId];
+        auto it = s.dueDates.find(dueDate);
+        if (it != s.dueDates.end())
+            s.dueDates.erase(it);
+        refresh(s);
+    }
+
+    // Called after bulk edits to transactions.csv that bypass borrow/return
+    static void invalidate()
+    {
+        summaries().clear();
+        loaded() = false;
+    }
+};
+
+// Vectorized kernels over packed status bitmaps (bit i = row i) and
+// contiguous int64 timestamp columns. AVX2 versions are picked at runtime;
+// the scalar versions give the same answers everywhere else.
+class ColumnScan
+{
+public:
+    static bool hasAvx2()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        return avx2;
+#else
+        return false;
+#endif
+    }
+
+    static size_t popcount(const uint64_t *words, size_t n)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        if (hasAvx2())
+            return popcountAvx2(words, nullptr, n);
+#endif
+        size_t count = 0;
+        for (size_t i = 0; i < n; ++i)
+            count += __builtin_popcountll(words[i]);
+        return count;
+    }
+
+    // Number of rows set in both bitmaps
+    static size_t popcountAnd(const uint64_t *a, const uint64_t *b, size_t n)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        if (hasAvx2())
+            return popcountAvx2(a, b, n);
+#endif
+        size_t count = 0;
+        for (size_t i = 0; i < n; ++i)
+            count += __builtin_popcountll(a[i] & b[i]);
+        return count;
+    }
+
+    // Sets bit i of out for every values[i] < bound
+    static void lessThan(const int64_t *values, size_t n, int64_t bound, uint64_t *out)
+    {
+        size_t i = 0;
+#if defined(__x86_64__) || defined(__i386__)
+        if (hasAvx2())
+            i = lessThanAvx2(values, n, bound, out);
+#endif
+        for (; i < n; ++i)
+        {
+            if (i % 64 == 0)
+                out[i / 64] = 0;
+            if (values[i] < bound)
+                out[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+
+    template <typename Fn>
+    static void forEachSet(const uint64_t *words, size_t n, Fn fn)
+    {
+        for (size_t w = 0; w < n; ++w)
+        {
+            for (uint64_t bits = words[w]; bits; bits &= bits - 1)
+                fn(w * 64 + __builtin_ctzll(bits));
+        }
+    }
+
+private:
+#if defined(__x86_64__) || defined(__i386__)
+    // Nibble lookup popcount: pshufb counts each 4-bit half, sad sums bytes
+    __attribute__((target("avx2"))) static size_t popcountAvx2(const uint64_t *a, const uint64_t *b, size_t n)
+    {
+        const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        const __m256i low = _mm256_set1_epi8(0x0f);
+        __m256i sums = _mm256_setzero_si256();
+
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(a + i));
+            if (b)
+                v = _mm256_and_si256(v, _mm256_loadu_si256((const __m256i *)(b + i)));
+            __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)),
+                                             _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+            sums = _mm256_add_epi64(sums, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+        }
+
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i *)lanes, sums);
+        size_t count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        for (; i < n; ++i)
+            count += __builtin_popcountll(b ? a[i] & b[i] : a[i]);
+        return count;
+    }
+
+    // Compares 64 values per output word; returns how many values it covered
+    __attribute__((target("avx2"))) static size_t lessThanAvx2(const int64_t *values, size_t n, int64_t bound, uint64_t *out)
+    {
+        const __m256i limit = _mm256_set1_epi64x(bound);
+        size_t words = n / 64;
+        for (size_t w = 0; w < words; ++w)
+        {
+            uint64_t bits = 0;
+            for (size_t j = 0; j < 64; j += 4)
+            {
+                __m256i v = _mm256_loadu_si256((const __m256i *)(values + w * 64 + j));
+                uint64_t mask = (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(limit, v)));
+                bits |= mask << j;
+            }
+            out[w] = bits;
+        }
+        return words * 64;
+    }
+#endif
+};
+
+// Packed columns of books.csv: availability and reservation flags
+struct BookColumns
+{
+    size_t rows = 0;
+    vector<uint64_t> available;
+    vector<uint64_t> reserved;
+
+    explicit BookColumns(const TableVersion &books)
+        : rows(books.size()), available((rows + 63) / 64), reserved((rows + 63) / 64)
+    {
+        for (size_t i = 0; i < rows; ++i)
+        {
+            const auto &book = books.row(i);
+            if (book.size() > 4 && book[4] == "0")
+                available[i / 64] |= 1ULL << (i % 64);
+            if (book.size() > 5 && book[5] == "1")
+                reserved[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+};
+
+// Packed columns of transactions.csv: the active flag and both timestamps
+struct LoanColumns
+{
+    size_t rows = 0;
+    vector<uint64_t> active;
+    vector<int64_t> issued;
+    vector<int64_t> due;
+
+    explicit LoanColumns(const TableVersion &loans)
+        : rows(loans.size()), active((rows + 63) / 64), issued(rows), due(rows)
+    {
+        for (size_t i = 0; i < rows; ++i)
+        {
+            const auto &trans = loans.row(i);
+            if (trans.size() < 6)
+                continue;
+            if (trans[5] == "0")
+                active[i / 64] |= 1ULL << (i % 64);
+            issued[i] = stoll(trans[3]);
+            due[i] = stoll(trans[4]);
+        }
+    }
+
+    // Bitmap of loans that are still out after their due date
+    vector<uint64_t> overdue(int64_t now) const
+    {
+        vector<uint64_t> bits(active.size());
+        ColumnScan::lessThan(due.data(), rows, now, bits.data());
+        for (size_t w = 0; w < bits.size(); ++w)
+            bits[w] &= active[w];
+        return bits;
+    }
+
+};
+
+// Borrowers of transactions.csv interned as small integers: each loan's
+// owner indexes members, which lists every User ID once
+struct LoanOwners
+{
+    vector<string> members;
+    vector<uint32_t> owner;
+
+    explicit LoanOwners(const TableVersion &loans) : owner(loans.size())
+    {
+        static const string none;
+        unordered_map<string, uint32_t> index;
+        for (size_t i = 0; i < loans.size(); ++i)
+        {
+            const auto &trans = loans.row(i);
+            const string &member = trans.empty() ? none : trans[0];
+            auto it = index.find(member);
+            if (it == index.end())
+            {
+                it = index.insert(make_pair(member, (uint32_t)members.size())).first;
+                members.push_back(member);
+            }
+            owner[i] = it->second;
+        }
+    }
+};
+
+// Member type of every User ID in users.csv
+struct MemberTypes
+{
+    unordered_map<string, int> types;
+
+    explicit MemberTypes(const TableVersion &users)
+    {
+        for (size_t i = 0; i < users.size(); ++i)
+        {
+            const auto &user = users.row(i);
+            if (user.size() > 3)
+                types[user[1]] = atoi(user[3].c_str());
+        }
+    }
+};
+
+// Rows of a table version by the User ID in the given column
+template <size_t Column>
+struct UserIndex
+{
+    unordered_map<string, vector<uint32_t>> rows;
+
+    explicit UserIndex(const TableVersion &table)
+    {
+        for (size_t i = 0; i < table.size(); ++i)
+        {
+            const auto &row = table.row(i);
+            if (row.size() > Column)
+                rows[row[Column]].push_back(i);
+        }
+    }
+};
+
+// Loan rows in due-date order, for date range lookups
+struct DueOrder
+{
+    vector<pair<int64_t, uint32_t>> rows;
+
+    explicit DueOrder(const TableVersion &loans)
+    {
+        rows.reserve(loans.size());
+        for (size_t i = 0; i < loans.size(); ++i)
+        {
+            const auto &trans = loans.row(i);
+            if (trans.size() > 4)
+                rows.push_back(make_pair((int64_t)stoll(trans[4]), (uint32_t)i));
+        }
+        sort(rows.begin(), rows.end());
+    }
+};
+
+// Computes the fine owed on every open loan in one batch. Open loans are
+// split by member type into contiguous int64 due-date columns, so each
+// policy's rate, grace period and cap apply as constants across a column.
+// Due dates, open flags and interned owners come from the column caches
+// of each table version, so a rerun on unchanged tables parses nothing.
+class FineAccrual
+{
+public:
+    struct Result
+    {
+        vector<string> members;
+        vector<double> fines;
+        vector<int> overdueLoans;
+        double total = 0.0;
+        size_t openLoans = 0;
+        size_t overdue = 0;
+        double columnsMs = 0.0;
+        double kernelMs = 0.0;
+    };
+
+    static bool vectorized() { return ColumnScan::hasAvx2(); }
+
+    static void accrue(const int64_t *due, size_t n, int64_t now, const LoanPolicy &policy, double *out)
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        if (vectorized())
+        {
+            accrueAvx2(due, n, now, policy, out);
+            return;
+        }
+#endif
+        accrueScalar(due, n, now, policy, out);
+    }
+
+    static Result run(const Snapshot &snapshot, time_t now)
+    {
+        Result result;
+        auto start = chrono::steady_clock::now();
+        auto users = columnsOf<MemberTypes>(snapshot.table("users.csv"));
+
+        // Loans in every branch; a member's fines are the sum across them
+        map<int, vector<int64_t>> dueColumns;
+        map<int, vector<uint32_t>> ownerColumns;
+        unordered_map<string, uint32_t> memberIndex;
+        for (const string &path : Branches::paths("transactions.csv"))
+        {
+            auto loans = snapshot.tables.find(path);
+            if (loans == snapshot.tables.end())
+                continue;
+            auto columns = columnsOf<LoanColumns>(loans->second);
+            auto owners = columnsOf<LoanOwners>(loans->second);
+
+            // Each borrower of the branch once: their index across branches
+            // and the policy they borrow under. Loans of unknown members
+            // are charged at the student rate.
+            vector<uint32_t> global(owners->members.size());
+            vector<int> typeOf(owners->members.size());
+            for (size_t m = 0; m < owners->members.size(); ++m)
+            {
+                const string &member = owners->members[m];
+                auto inserted = memberIndex.insert(make_pair(member, (uint32_t)result.members.size()));
+                if (inserted.second)
+                    result.members.push_back(member);
+                global[m] = inserted.first->second;
+                auto type = users->types.find(member);
+                typeOf[m] = type != users->types.end() && type->second != 3 ? type->second : 1;
+            }
+
+            ColumnScan::forEachSet(columns->active.data(), columns->active.size(), [&](size_t i)
+                                   {
+                uint32_t owner = owners->owner[i];
+                dueColumns[typeOf[owner]].push_back(columns->due[i]);
+                ownerColumns[typeOf[owner]].push_back(global[owner]);
+                result.openLoans++; });
+        }
+        result.columnsMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        result.fines.assign(result.members.size(), 0.0);
+        result.overdueLoans.assign(result.members.size(), 0);
+        vector<double> fines;
+        for (auto &column : dueColumns)
+        {
+            const vector<uint32_t> &owners = ownerColumns[column.first];
+            fines.resize(column.second.size());
+
+            auto start = chrono::steady_clock::now();
+            accrue(column.second.data(), column.second.size(), now, LoanPolicy::forType(column.first), fines.data());
+            result.kernelMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+            for (size_t i = 0; i < fines.size(); ++i)
+            {
+                if (fines[i] <= 0)
+                    continue;
+                result.fines[owners[i]] += fines[i];
+                result.overdueLoans[owners[i]]++;
+                result.total += fines[i];
+                result.overdue++;
+            }
+        }
+        return result;
+    }
+
+private:
+    static void accrueScalar(const int64_t *due, size_t n, int64_t now, const LoanPolicy &policy, double *out)
+    {
+        double cap = policy.fineCap > 0 ? policy.fineCap : numeric_limits<double>::infinity();
+        for (size_t i = 0; i < n; ++i)
+        {
+            int64_t age = max<int64_t>(now - due[i], 0);
+            double chargeable = max<double>(age / 86400 - policy.graceDays, 0.0);
+            out[i] = min(chargeable * policy.dailyFine, cap);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    // Four loans per iteration. Ages are clamped to [0, 2^51) so they can be
+    // turned into doubles exactly with the 2^52 exponent trick, as AVX2 has
+    // no int64 to double conversion.
+    __attribute__((target("avx2"))) static void accrueAvx2(const int64_t *due, size_t n, int64_t now,
+                                                         const LoanPolicy &policy, double *out)
+    {
+        const __m256i nowV = _mm256_set1_epi64x(now);
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i maxAge = _mm256_set1_epi64x(1LL << 51);
+        const __m256i exponent = _mm256_set1_epi64x(0x4330000000000000LL);
+        const __m256d twoTo52 = _mm256_set1_pd(4503599627370496.0);
+        const __m256d secondsPerDay = _mm256_set1_pd(86400.0);
+        const __m256d grace = _mm256_set1_pd(policy.graceDays);
+        const __m256d rate = _mm256_set1_pd(policy.dailyFine);
+        const __m256d cap = _mm256_set1_pd(policy.fineCap > 0 ? policy.fineCap : numeric_limits<double>::infinity());
+        const __m256d none = _mm256_setzero_pd();
+
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4)
+        {
+            __m256i age = _mm256_sub_epi64(nowV, _mm256_loadu_si256((const __m256i *)(due + i)));
+            age = _mm256_andnot_si256(_mm256_cmpgt_epi64(zero, age), age);
+            age = _mm256_blendv_epi8(age, maxAge, _mm256_cmpgt_epi64(age, maxAge));
+            __m256d seconds = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(age, exponent)), twoTo52);
+            __m256d days = _mm256_floor_pd(_mm256_div_pd(seconds, secondsPerDay));
+            __m256d chargeable = _mm256_max_pd(_mm256_sub_pd(days, grace), none);
+            _mm256_storeu_pd(out + i, _mm256_min_pd(_mm256_mul_pd(chargeable, rate), cap));
+        }
+        accrueScalar(due + i, n - i, now, policy, out + i);
+    }
+#endif
+};
+
+// Fines per member as of the last accrual run, kept in fines.csv
+// (UserID,Fines,OverdueLoans,ComputedAt). Lookups are a hash probe; the
+// file is re-read only when another process has rewritten it.
+class FineLedger
+{
+private:
+    struct Entry
+    {
+        double fines;
+        int overdueLoans;
+    };
+
+    static unordered_map<string, Entry> &entries()
+    {
+        static unordered_map<string, Entry> ledger;
+        return ledger;
+    }
+
+    static time_t &computedAt()
+    {
+        static time_t at = 0;
+        return at;
+    }
+
+    static void refresh()
+    {
+        static time_t loadedMtime = -1;
+        struct stat info;
+        if (stat("fines.csv", &info) != 0 || info.st_mtime == loadedMtime)
+            return;
+        loadedMtime = info.st_mtime;
+
+        ifstream file("fines.csv");
+        entries().clear();
+        computedAt() = 0;
+        string line;
+        while (getline(file, line))
+        {
+            vector<string> row;
+            stringstream ss(line);
+            string field;
+            while (getline(ss, field, ','))
+                row.push_back(field);
+            if (row.size() < 4)
+                continue;
+            entries()[row[0]] = {stod(row[1]), stoi(row[2])};
+            computedAt() = stol(row[3]);
+        }
+    }
+
+public:
+    // Fines owed by a member at the last run; false if no run has happened
+    static bool lookup(const string &memberId, double &fines, time_t &asOf)
+    {
+        refresh();
+        if (computedAt() == 0)
+            return false;
+        auto it = entries().find(memberId);
+        fines = it != entries().end() ? it->second.fines : 0.0;
+        asOf = computedAt();
+        return true;
+    }
+
+    // The nightly job: accrues fines on every open loan and rewrites the ledger
+    static void runAccrual()
+    {
+        time_t now = time(0);
+        auto start = chrono::steady_clock::now();
+        auto snapshot = FileManager::pin();
+        double loadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        FineAccrual::Result result = FineAccrual::run(*snapshot, now);
+        auto writing = chrono::steady_clock::now();
+
+        vector<vector<string>> rows;
+        for (size_t i = 0; i < result.members.size(); ++i)
+        {
+            if (result.fines[i] <= 0)
+                continue;
+            ostringstream amount;
+            amount << fixed << setprecision(2) << result.fines[i];
+            rows.push_back({result.members[i], amount.str(), to_string(result.overdueLoans[i]), to_string(now)});
+        }
+        // A marker row records the run time even when nobody owes anything
+        rows.push_back({"", "0.00", "0", to_string(now)});
+        FileManager::writeFile("fines.csv", rows);
+        refresh();
+        double writeMs = chrono::duration<double, milli>(chrono::steady_clock::now() - writing).count();
+
+        double totalMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << "Fine accrual: " << result.openLoans << " open loans, " << result.overdue
+             << " overdue, ₹" << fixed << setprecision(2) << result.total << " owed by "
+             << rows.size() - 1 << " member(s)\n"
+             << "Completed in " << setprecision(1) << totalMs << " ms: load " << loadMs << " ms, columns "
+             << result.columnsMs << " ms, kernel " << setprecision(3) << result.kernelMs << " ms ("
+             << (FineAccrual::vectorized() ? "AVX2" : "scalar") << "), write " << setprecision(1) << writeMs
+             << " ms\n";
+    }
+};
+
+// Closed loans moved out of transactions.csv into transactions.archive.
+// Rows are sorted by borrow date and stored in blocks of up to 4096; each
+// block has its own dictionaries of User IDs and packed ISBNs, keeps no
+// titles, delta/varint encodes the dates and packs the status into bits.
+// A fixed header with the block's date ranges and a mask of its users
+// lets history scans skip whole blocks without reading them.
+class LoanArchive
+{
+public:
+    // Where the primary keeps its data, with a trailing slash; empty for
+    // the working directory. A replica reads the archive next to the
+    // primary's log.
+    static string &directory()
+    {
+        static string dir;
+        return dir;
+    }
+
+    struct Loan
+    {
+        string userId;
+        uint64_t isbn;
+        time_t borrowed;
+        time_t due;
+        bool returned;
+    };
+
+    struct ScanStats
+    {
+        size_t blocks = 0;
+        size_t blocksRead = 0;
+        uint64_t bytesRead = 0;
+        uint64_t fileBytes = 0;
+        uint64_t validBytes = 0; // up to the end of the last complete block
+    };
+
+private:
+    static const size_t blockRows = 4096;
+
+    struct BlockHeader
+    {
+        uint32_t bytes;
+        uint32_t rows;
+        int64_t minBorrow;
+        int64_t maxBorrow;
+        int64_t minDue;
+        int64_t maxDue;
+        uint64_t userMask;
+    };
+
+    // The current branch's archive
+    static string path() { return directory() + Branches::path("transactions.archive"); }
+
+    static uint64_t userBit(const string &id) { return 1ULL << (KeyFilters::userHash(id) & 63); }
+
+    static void putVarint(string &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back((char)(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back((char)value);
+    }
+
+    static void putSigned(string &out, int64_t value) { putVarint(out, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63)); }
+
+    static uint64_t getVarint(const char *&p, const char *end)
+    {
+        uint64_t value = 0;
+        for (int shift = 0; p < end && shift < 64; shift += 7)
+        {
+            uint8_t byte = (uint8_t)*p++;
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        throw runtime_error("Corrupt archive block");
+    }
+
+    static int64_t getSigned(const char *&p, const char *end)
+    {
+        uint64_t value = getVarint(p, end);
+        return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+    }
+
+    // Encodes loans[begin, end), which are sorted by borrow date
+    static string encodeBlock(const vector<Loan> &loans, size_t begin, size_t end)
+    {
+        BlockHeader header = {};
+        header.rows = end - begin;
+        header.minBorrow = loans[begin].borrowed;
+        header.maxBorrow = loans[end - 1].borrowed;
+        header.minDue = numeric_limits<int64_t>::max();
+        header.maxDue = numeric_limits<int64_t>::min();
+
+        vector<string> users;
+        vector<uint64_t> isbns;
+        unordered_map<string, uint64_t> userIds;
+        unordered_map<uint64_t, uint64_t> isbnIds;
+        string userColumn, isbnColumn, borrowColumn, dueColumn;
+        string status((header.rows + 7) / 8, '\0');
+        int64_t previous = header.minBorrow;
+
+        for (size_t i = begin; i < end; ++i)
+        {
+            const Loan &loan = loans[i];
+            auto user = userIds.insert(make_pair(loan.userId, users.size()));
+            if (user.second)
+                users.push_back(loan.userId);
+            auto isbn = isbnIds.insert(make_pair(loan.isbn, isbns.size()));
+            if (isbn.second)
+                isbns.push_back(loan.isbn);
+
+            putVarint(userColumn, user.first->second);
+            putVarint(isbnColumn, isbn.first->second);
+            putSigned(borrowColumn, loan.borrowed - previous);
+            putSigned(dueColumn, loan.due - loan.borrowed);
+            previous = loan.borrowed;
+            if (loan.returned)
+                status[(i - begin) / 8] |= (char)(1 << ((i - begin) % 8));
+
+            header.minDue = min<int64_t>(header.minDue, loan.due);
+            header.maxDue = max<int64_t>(header.maxDue, loan.due);
+            header.userMask |= userBit(loan.userId);
+        }
+
+        string payload;
+        putVarint(payload, users.size());
+        for (auto &user : users)
+        {
+            putVarint(payload, user.size());
+            payload += user;
+        }
+        putVarint(payload, isbns.size());
+        for (uint64_t isbn : isbns)
+            putVarint(payload, isbn);
+        payload += userColumn + isbnColumn + borrowColumn + dueColumn + status;
+
+        header.bytes = payload.size();
+        return string((const char *)&header, sizeof(header)) + payload;
+    }
+
+    // Decodes the loans of one block that were borrowed between from and
+    // to and, when a user is given, belong to that user
+    static void decodeBlock(const BlockHeader &header, const string &payload, const string &userId,
+                            time_t from, time_t to, const function<void(const Loan &)> &visit)
+    {
+        size_t statusBytes = (header.rows + 7) / 8;
+        if (payload.size() < statusBytes)
+            throw runtime_error("Corrupt archive block");
+        const char *p = payload.data();
+        const char *end = p + payload.size() - statusBytes;
+        const uint8_t *status = (const uint8_t *)end;
+
+        vector<string> users(getVarint(p, end));
+        uint64_t wanted = users.size();
+        for (size_t i = 0; i < users.size(); ++i)
+        {
+            uint64_t length = getVarint(p, end);
+            if (length > (uint64_t)(end - p))
+                throw runtime_error("Corrupt archive block");
+            users[i].assign(p, length);
+            p += length;
+            if (users[i] == userId)
+                wanted = i;
+        }
+        // The user mask can match by chance; the dictionary is exact
+        if (!userId.empty() && wanted == users.size())
+            return;
+
+        vector<uint64_t> isbns(getVarint(p, end));
+        for (auto &isbn : isbns)
+            isbn = getVarint(p, end);
+
+        vector<uint64_t> userColumn(header.rows), isbnColumn(header.rows);
+        for (auto &id : userColumn)
+            id = getVarint(p, end);
+        for (auto &id : isbnColumn)
+            id = getVarint(p, end);
+
+        vector<int64_t> borrowed(header.rows);
+        int64_t previous = header.minBorrow;
+        for (auto &date : borrowed)
+            previous = date = previous + getSigned(p, end);
+
+        Loan loan;
+        for (size_t i = 0; i < header.rows; ++i)
+        {
+            int64_t due = borrowed[i] + getSigned(p, end);
+            if (userColumn[i] >= users.size() || isbnColumn[i] >= isbns.size())
+                throw runtime_error("Corrupt archive block");
+            if (borrowed[i] < from || borrowed[i] > to || (!userId.empty() && userColumn[i] != wanted))
+                continue;
+            loan.userId = users[userColumn[i]];
+            loan.isbn = isbns[isbnColumn[i]];
+            loan.borrowed = borrowed[i];
+            loan.due = due;
+            loan.returned = (status[i / 8] >> (i % 8)) & 1;
+            visit(loan);
+        }
+        if (p != end)
+            throw runtime_error("Corrupt archive block");
+    }
+
+public:
+    // Visits archived loans borrowed between from and to (inclusive),
+    // optionally for one user only, reading only the blocks that can hold them.
+    // A block cut short by a crash ends the archive.
+    static ScanStats scan(const string &userId, time_t from, time_t to, const function<void(const Loan &)> &visit)
+    {
+        ScanStats stats;
+        ifstream file(path(), ios::binary | ios::ate);
+        if (!file || file.tellg() <= 0)
+            return stats;
+        stats.fileBytes = file.tellg();
+        file.seekg(0);
+
+        char magic[8];
+        if (!file.read(magic, 8) || memcmp(magic, "LMSARCH1", 8) != 0)
+            throw runtime_error("Not a loan archive: " + path());
+        stats.bytesRead = stats.validBytes = 8;
+
+        BlockHeader header;
+        string payload;
+        while (file.read((char *)&header, sizeof(header)))
+        {
+            stats.bytesRead += sizeof(header);
+            uint64_t next = stats.validBytes + sizeof(header) + header.bytes;
+            if (next > stats.fileBytes)
+                break;
+
+            bool skip = header.maxBorrow < from || header.minBorrow > to ||
+                        (!userId.empty() && !(header.userMask & userBit(userId)));
+            if (skip)
+                file.seekg(header.bytes, ios::cur);
+            else
+            {
+                payload.resize(header.bytes);
+                file.read(&payload[0], header.bytes);
+                stats.blocksRead++;
+                stats.bytesRead += header.bytes;
+                decodeBlock(header, payload, userId, from, to, visit);
+            }
+            stats.blocks++;
+            stats.validBytes = next;
+        }
+        return stats;
+    }
+
+    // Moves closed loans borrowed before the cutoff into the archive.
+    // Returns how many rows left transactions.csv.
+    static size_t archiveClosed(time_t cutoff)
+    {
+        FileManager fm;
+        fm.loadFile("transactions.csv");
+        vector<Loan> moved;
+        vector<vector<string>> kept;
+        for (auto &row : fm.getData())
+        {
+            uint64_t key = row.size() >= 6 ? Isbn::pack(row[2]) : 0;
+            if (key != 0 && row[5] != "0" && stol(row[3]) < cutoff)
+                moved.push_back({row[0], key, (time_t)stol(row[3]), (time_t)stol(row[4]), true});
+            else
+                kept.push_back(row);
+        }
+        if (moved.empty())
+            return 0;
+        stable_sort(moved.begin(), moved.end(), [](const Loan &a, const Loan &b)
+                    { return a.borrowed < b.borrowed; });
+
+        // Loans an interrupted earlier run archived but did not remove
+        // from the CSV are not archived twice
+        set<tuple<string, uint64_t, time_t>> archived;
+        scan("", moved.front().borrowed, moved.back().borrowed, [&](const Loan &loan)
+             { archived.insert(make_tuple(loan.userId, loan.isbn, loan.borrowed)); });
+        vector<Loan> fresh;
+        for (auto &loan : moved)
+        {
+            if (!archived.count(make_tuple(loan.userId, loan.isbn, loan.borrowed)))
+                fresh.push_back(loan);
+        }
+
+        if (!fresh.empty())
+        {
+            // A block cut short by a crash is dropped; its rows are still in the CSV
+            // An empty date range reads only the block headers
+            ScanStats stats = scan("", numeric_limits<time_t>::max(), numeric_limits<time_t>::min(), [](const Loan &) {});
+            if (stats.validBytes < stats.fileBytes && truncate(path().c_str(), stats.validBytes) != 0)
+                throw runtime_error("Cannot repair " + path());
+            ofstream file(path(), ios::binary | ios::app);
+            if (stats.validBytes == 0)
+                file.write("LMSARCH1", 8);
+            for (size_t begin = 0; begin < fresh.size(); begin += blockRows)
+            {
+                string block = encodeBlock(fresh, begin, min(fresh.size(), begin + blockRows));
+                file.write(block.data(), block.size());
+            }
+            file.flush();
+            if (!file)
+                throw runtime_error("Cannot write " + path());
+        }
+
+        fm.getData().swap(kept);
+        fm.saveFile("transactions.csv");
+        LoanPolicyEngine::invalidate();
+        return moved.size();
+    }
+
+    static void run(int days, const string &actor)
+    {
+        auto start = chrono::steady_clock::now();
+        size_t moved = archiveClosed(time(0) - (time_t)days * 86400);
+        AuditLog::record(actor, "ARCHIVE_LOANS", "", to_string(moved) + " loans");
+        ScanStats stats = scan("", numeric_limits<time_t>::max(), numeric_limits<time_t>::min(), [](const Loan &) {});
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << Branches::tag(Branches::current()) << moved << " closed loan(s) archived. Archive: " << stats.blocks << " block(s), "
+             << stats.fileBytes << " bytes (" << fixed << setprecision(1) << ms << " ms)\n";
+    }
+};
+
+// "Readers also borrowed": for each ISBN, the ISBNs most often borrowed by
+// the same members, with the number of such members. Built once from the
+// loan history and archive, then updated on each borrow. A list holds at
+// most listCap neighbours; a newcomer to a full list takes the place of the
+// weakest one with its count plus one (space-saving), which bounds memory
+// and keeps each list sorted, so a lookup reads only its first k entries.
+class CoBorrowIndex
+{
+public:
+    typedef vector<pair<uint64_t, uint32_t>> Neighbours;
+
+private:
+    static const size_t listCap = 32;
+    static const size_t historyCap = 64; // latest distinct ISBNs kept per member
+
+    struct State
+    {
+        once_flag built;
+        mutex guard;
+        unordered_map<uint64_t, Neighbours> lists;
+        unordered_map<string, vector<uint64_t>> recent;
+    };
+
+    static State &state()
+    {
+        static State s;
+        return s;
+    }
+
+    static void bump(Neighbours &list, uint64_t isbn)
+    {
+        size_t i = 0;
+        while (i < list.size() && list[i].first != isbn)
+            ++i;
+        if (i < list.size())
+            list[i].second++;
+        else if (list.size() < listCap)
+            list.push_back(make_pair(isbn, 1u));
+        else
+        {
+            i = list.size() - 1;
+            list[i] = make_pair(isbn, list[i].second + 1);
+        }
+        for (; i > 0 && list[i - 1].second < list[i].second; --i)
+            swap(list[i - 1], list[i]);
+    }
+
+    // Adds an ISBN to a member's history; false if it was already there
+    static bool remember(vector<uint64_t> &history, uint64_t isbn)
+    {
+        if (find(history.begin(), history.end(), isbn) != history.end())
+            return false;
+        if (history.size() == historyCap)
+            history.erase(history.begin());
+        history.push_back(isbn);
+        return true;
+    }
+
+    static void build()
+    {
+        State &s = state();
+        unordered_map<string, vector<uint64_t>> histories;
+        auto snapshot = FileManager::pin();
+        for (size_t b = 0; b < Branches::count(); ++b)
+        {
+            Branches::Scope scope(b);
+            LoanArchive::scan("", numeric_limits<time_t>::min(), numeric_limits<time_t>::max(),
+                              [&](const LoanArchive::Loan &loan)
+                              { remember(histories[loan.userId], loan.isbn); });
+
+            auto loans = snapshot->table("transactions.csv");
+            for (size_t i = 0; i < loans->size(); ++i)
+            {
+                const auto &trans = loans->row(i);
+                uint64_t key = trans.size() > 2 ? Isbn::pack(trans[2]) : 0;
+                if (key != 0)
+                    remember(histories[trans[0]], key);
+            }
+        }
+
+        // ISBNs get dense ids, so counting uses plain arrays
+        unordered_map<uint64_t, uint32_t> ids;
+        vector<uint64_t> keys;
+        vector<vector<uint32_t>> members;
+        vector<vector<uint32_t>> readers; // members who borrowed each ISBN
+        for (auto &entry : histories)
+        {
+            members.push_back(vector<uint32_t>());
+            for (uint64_t isbn : entry.second)
+            {
+                auto id = ids.insert(make_pair(isbn, (uint32_t)keys.size()));
+                if (id.second)
+                {
+                    keys.push_back(isbn);
+                    readers.push_back(vector<uint32_t>());
+                }
+                members.back().push_back(id.first->second);
+                readers[id.first->second].push_back(members.size() - 1);
+            }
+        }
+
+        // Each thread ranks the neighbours of the ISBNs it owns, so the
+        // threads share no counters and their lists need no merging
+        unsigned workers = max(1u, thread::hardware_concurrency());
+        vector<unordered_map<uint64_t, Neighbours>> shards(workers);
+        vector<thread> threads;
+        for (unsigned t = 0; t < workers; ++t)
+        {
+            threads.push_back(thread([&, t]()
+                                     {
+                vector<uint32_t> counts(keys.size(), 0);
+                vector<uint32_t> touched;
+                for (size_t a = t; a < keys.size(); a += workers)
+                {
+                    for (uint32_t member : readers[a])
+                        for (uint32_t b : members[member])
+                            if (b != a && counts[b]++ == 0)
+                                touched.push_back(b);
+
+                    Neighbours list;
+                    list.reserve(touched.size());
+                    for (uint32_t b : touched)
+                    {
+                        list.push_back(make_pair(keys[b], counts[b]));
+                        counts[b] = 0;
+                    }
+                    touched.clear();
+
+                    size_t keep = min<size_t>(size_t(listCap), list.size());
+                    partial_sort(list.begin(), list.begin() + keep, list.end(),
+                                 [](const pair<uint64_t, uint32_t> &x, const pair<uint64_t, uint32_t> &y)
+                                 { return x.second > y.second || (x.second == y.second && x.first < y.first); });
+                    list.resize(keep);
+                    if (!list.empty())
+                        shards[t][keys[a]].swap(list);
+                } }));
+        }
+        for (auto &worker : threads)
+            worker.join();
+
+        lock_guard<mutex> lock(s.guard);
+        for (auto &shard : shards)
+            for (auto &entry : shard)
+                s.lists[entry.first].swap(entry.second);
+        s.recent.swap(histories);
+    }
+
+public:
+    static void ensureBuilt() { call_once(state().built, &CoBorrowIndex::build); }
+
+    // The k ISBNs most often borrowed by readers of this one
+    static Neighbours top(uint64_t isbn, size_t k)
+    {
+        ensureBuilt();
+        State &s = state();
+        lock_guard<mutex> lock(s.guard);
+        auto it = s.lists.find(isbn);
+        if (it == s.lists.end())
+            return Neighbours();
+        return Neighbours(it->second.begin(), it->second.begin() + min(k, it->second.size()));
+    }
+
+    // Called once the loan is recorded. A book the member has borrowed
+    // before adds no new pairs.
+    static void recordBorrow(const string &memberId, uint64_t isbn)
+    {
+        ensureBuilt();
+        State &s = state();
+        lock_guard<mutex> lock(s.guard);
+        auto &history = s.recent[memberId];
+        if (find(history.begin(), history.end(), isbn) != history.end())
+            return;
+        for (uint64_t other : history)
+        {
+            bump(s.lists[isbn], other);
+            bump(s.lists[other], isbn);
+        }
+        remember(history, isbn);
+    }
+};
+
+// Daily circulation counts by member type and publisher, kept in
+// rollups.csv (Day,MemberType,Publisher,Loans,Returns,Reservations,Overdue)
+// so trend reports read one row per day and group instead of the loan
+// history. Borrow, return and reserve append a one-event delta row; rows
+// with the same key are summed when the file is opened, and the file is
+// then rewritten compacted. A missing file is backfilled in parallel from
+// the loans, the archive and the reservations. Overdue counts the loans
+// that became overdue on a day (the day after their due date); a sweep
+// adds them from the open loans once a day and records the last day it
+// covered in a "swept" row.
+class CirculationRollups
+{
+public:
+    struct Counts
+    {
+        long loans = 0;
+        long returns = 0;
+        long reservations = 0;
+        long overdue = 0;
+
+        void add(const Counts &other)
+        {
+            loans += other.loans;
+            returns += other.returns;
+            reservations += other.reservations;
+            overdue += other.overdue;
+        }
+    };
+
+private:
+    typedef tuple<int, int, string> Key; // day, member type, publisher
+    typedef map<Key, Counts> Rows;
+
+    struct State
+    {
+        mutex guard;
+        Rows rows;
+        int sweptThrough = 0;
+        bool ready = false;
+    };
+
+    static State &state()
+    {
+        static State s;
+        return s;
+    }
+
+    static const char *path() { return "rollups.csv"; }
+
+    // Local days since 1970, at the UTC offset the process started with
+    static int dayOf(time_t t)
+    {
+        static const long offset = []()
+        {
+            time_t now = time(0);
+            tm local;
+            localtime_r(&now, &local);
+            return local.tm_gmtoff;
+        }();
+        return (int)floor((t + offset) / 86400.0);
+    }
+
+    static string dayText(int day)
+    {
+        time_t at = (time_t)day * 86400;
+        tm date;
+        gmtime_r(&at, &date);
+        char buffer[16];
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d", &date);
+        return buffer;
+    }
+
+    static int parseDay(const string &text)
+    {
+        int y, m, d;
+        if (sscanf(text.c_str(), "%d-%d-%d", &y, &m, &d) != 3)
+            throw runtime_error("Invalid rollup day: " + text);
+        return Dates::civilDay(y, m, d);
+    }
+
+    static vector<string> rowOf(const Key &key, const Counts &c)
+    {
+        return {dayText(get<0>(key)), to_string(get<1>(key)), get<2>(key), to_string(c.loans),
+                to_string(c.returns), to_string(c.reservations), to_string(c.overdue)};
+    }
+
+    static void append(const vector<vector<string>> &rows)
+    {
+        ofstream file(path(), ios::app);
+        for (auto &row : rows)
+        {
+            for (size_t i = 0; i < row.size(); ++i)
+                file << (i ? "," : "") << row[i];
+            file << "\n";
+        }
+    }
+
+    static bool load(State &s)
+    {
+        ifstream file(path());
+        if (!file)
+            return false;
+        string line;
+        while (getline(file, line))
+        {
+            vector<string> row;
+            stringstream ss(line);
+            string field;
+            while (getline(ss, field, ','))
+                row.push_back(field);
+            if (row.size() == 2 && row[0] == "swept")
+                s.sweptThrough = max(s.sweptThrough, parseDay(row[1]));
+            if (row.size() < 7)
+                continue;
+            Counts c;
+            c.loans = stol(row[3]);
+            c.returns = stol(row[4]);
+            c.reservations = stol(row[5]);
+            c.overdue = stol(row[6]);
+            s.rows[Key(parseDay(row[0]), stoi(row[1]), row[2])].add(c);
+        }
+        return true;
+    }
+
+    static unordered_map<string, int> memberTypes(const Snapshot &snapshot)
+    {
+        unordered_map<string, int> types;
+        auto users = snapshot.table("users.csv");
+        for (size_t i = 0; i < users->size(); ++i)
+        {
+            const auto &user = users->row(i);
+            if (user.size() > 3)
+                types[user[1]] = atoi(user[3].c_str());
+        }
+        return types;
+    }
+
+    static unordered_map<uint64_t, string> publishers(const Snapshot &snapshot, size_t branch)
+    {
+        unordered_map<uint64_t, string> names;
+        auto books = snapshot.table(Branches::pathIn(branch, "books.csv"));
+        for (size_t i = 0; i < books->size(); ++i)
+        {
+            const auto &book = books->row(i);
+            if (uint64_t key = book.size() > 3 ? Isbn::pack(book[2]) : 0)
+                names.insert(make_pair(key, book[3]));
+        }
+        return names;
+    }
+
+    // Historical returns carry no date, so a returned loan counts as
+    // returned on its due date (or today, if that is still to come)
+    static void countLoan(Rows &rows, const Key &book, time_t borrowed, time_t due, bool returned,
+                          time_t now, int today)
+    {
+        int type = get<1>(book);
+        const string &publisher = get<2>(book);
+        rows[Key(dayOf(borrowed), type, publisher)].loans++;
+        if (returned)
+            rows[Key(dayOf(min(due, now)), type, publisher)].returns++;
+        else if (dayOf(due) + 1 <= today)
+            rows[Key(dayOf(due) + 1, type, publisher)].overdue++;
+    }
+
+    // Counts every branch's loans, archive and reservations. Slices of the
+    // tables and whole archives are shared out to a pool of threads, each
+    // counting into its own rows, which are merged at the end.
+    static void backfill(State &s, time_t now)
+    {
+        auto start = chrono::steady_clock::now();
+        auto snapshot = FileManager::pin();
+        auto types = memberTypes(*snapshot);
+        vector<unordered_map<uint64_t, string>> names;
+        for (size_t b = 0; b < Branches::count(); ++b)
+            names.push_back(publishers(*snapshot, b));
+        int today = dayOf(now);
+
+        struct Slice
+        {
+            size_t branch;
+            int kind; // 0 loans, 1 archive, 2 reservations
+            size_t begin;
+            size_t end;
+        };
+        const size_t sliceRows = 65536;
+        vector<Slice> slices;
+        for (size_t b = 0; b < Branches::count(); ++b)
+        {
+            size_t loans = snapshot->table(Branches::pathIn(b, "transactions.csv"))->size();
+            for (size_t begin = 0; begin < loans; begin += sliceRows)
+                slices.push_back({b, 0, begin, min(loans, begin + sliceRows)});
+            slices.push_back({b, 1, 0, 0});
+            slices.push_back({b, 2, 0, snapshot->table(Branches::pathIn(b, "reservations.csv"))->size()});
+        }
+
+        auto keyOf = [&](size_t branch, const string &user, uint64_t isbn)
+        {
+            auto type = types.find(user);
+            auto publisher = names[branch].find(isbn);
+            return Key(0, type != types.end() ? type->second : 0,
+                       publisher != names[branch].end() ? publisher->second : "");
+        };
+
+        unsigned workers = min((unsigned)slices.size(), max(1u, thread::hardware_concurrency()));
+        vector<Rows> partial(workers);
+        vector<size_t> counted(workers, 0);
+        vector<exception_ptr> errors(workers);
+        atomic<size_t> next(0);
+        vector<thread> threads;
+        for (unsigned w = 0; w < workers; ++w)
+        {
+            threads.push_back(thread([&, w]()
+                                     {
+                try
+                {
+                    size_t i;
+                    while ((i = next++) < slices.size())
+                    {
+                        const Slice &slice = slices[i];
+                        if (slice.kind == 0)
+                        {
+                            auto table = snapshot->table(Branches::pathIn(slice.branch, "transactions.csv"));
+                            auto loans = columnsOf<LoanColumns>(table);
+                            for (size_t r = slice.begin; r < slice.end; ++r)
+                            {
+                                const auto &trans = table->row(r);
+                                if (trans.size() < 6)
+                                    continue;
+                                bool active = loans->active[r / 64] >> (r % 64) & 1;
+                                countLoan(partial[w], keyOf(slice.branch, trans[0], Isbn::pack(trans[2])),
+                                          loans->issued[r], loans->due[r], !active, now, today);
+                                counted[w]++;
+                            }
+                        }
+                        else if (slice.kind == 1)
+                        {
+                            Branches::Scope scope(slice.branch);
+                            LoanArchive::scan("", numeric_limits<time_t>::min(), numeric_limits<time_t>::max(),
+                                              [&](const LoanArchive::Loan &loan)
+                                              {
+                                countLoan(partial[w], keyOf(slice.branch, loan.userId, loan.isbn),
+                                          loan.borrowed, loan.due, loan.returned, now, today);
+                                counted[w]++; });
+                        }
+                        else
+                        {
+                            auto table = snapshot->table(Branches::pathIn(slice.branch, "reservations.csv"));
+                            for (size_t r = slice.begin; r < slice.end; ++r)
+                            {
+                                const auto &res = table->row(r);
+                                if (res.size() < 4)
+                                    continue;
+                                Key key = keyOf(slice.branch, res[0], Isbn::pack(res[2]));
+                                partial[w][Key(dayOf(atoll(res[3].c_str())), get<1>(key), get<2>(key))].reservations++;
+                                counted[w]++;
+                            }
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    errors[w] = current_exception();
+                } }));
+        }
+        for (auto &worker : threads)
+            worker.join();
+        for (auto &error : errors)
+        {
+            if (error)
+                rethrow_exception(error);
+        }
+
+        size_t total = 0;
+        for (unsigned w = 0; w < workers; ++w)
+        {
+            for (auto &entry : partial[w])
+                s.rows[entry.first].add(entry.second);
+            total += counted[w];
+        }
+        s.sweptThrough = today;
+
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cerr << "Backfilled daily rollups from " << total << " record(s) into " << s.rows.size()
+             << " row(s) in " << fixed << setprecision(1) << ms << " ms on " << workers << " thread(s).\n";
+    }
+
+    // Adds the loans that became overdue since the last sweep: open loans
+    // whose first overdue day has now come
+    static void sweep(State &s, time_t now)
+    {
+        int today = dayOf(now);
+        if (s.sweptThrough >= today)
+            return;
+
+        auto snapshot = FileManager::pin();
+        unordered_map<string, int> types;
+        Rows fresh;
+        for (size_t b = 0; b < Branches::count(); ++b)
+        {
+            auto table = snapshot->table(Branches::pathIn(b, "transactions.csv"));
+            auto loans = columnsOf<LoanColumns>(table);
+            unordered_map<uint64_t, string> names;
+            ColumnScan::forEachSet(loans->active.data(), loans->active.size(), [&](size_t i)
+                                   {
+                int day = dayOf(loans->due[i]) + 1;
+                if (day <= s.sweptThrough || day > today)
+                    return;
+                if (types.empty())
+                    types = memberTypes(*snapshot);
+                if (names.empty())
+                    names = publishers(*snapshot, b);
+                const auto &trans = table->row(i);
+                auto type = types.find(trans[0]);
+                auto publisher = names.find(Isbn::pack(trans[2]));
+                fresh[Key(day, type != types.end() ? type->second : 0,
+                          publisher != names.end() ? publisher->second : "")].overdue++; });
+        }
+
+        vector<vector<string>> lines;
+        for (auto &entry : fresh)
+        {
+            s.rows[entry.first].add(entry.second);
+            lines.push_back(rowOf(entry.first, entry.second));
+        }
+        s.sweptThrough = today;
+        lines.push_back({"swept", dayText(today)});
+        append(lines);
+    }
+
+    static void record(int memberType, const string &publisher, Counts delta)
+    {
+        State &s = state();
+        lock_guard<mutex> lock(s.guard);
+        if (!s.ready)
+            return;
+        time_t now = time(0);
+        sweep(s, now);
+        Key key(dayOf(now), memberType, publisher);
+        s.rows[key].add(delta);
+        append({rowOf(key, delta)});
+    }
+
+    static string typeName(int type)
+    {
+        return type == 1 ? "Student" : type == 2 ? "Faculty" : type == 3 ? "Librarian" : "Unknown";
+    }
+
+public:
+    // Loads, or backfills, the rollups and rewrites them compacted
+    static void open()
+    {
+        State &s = state();
+        lock_guard<mutex> lock(s.guard);
+        time_t now = time(0);
+        s.rows.clear();
+        s.sweptThrough = 0;
+        if (!load(s))
+            backfill(s, now);
+        sweep(s, now);
+
+        vector<vector<string>> rows;
+        for (auto &entry : s.rows)
+            rows.push_back(rowOf(entry.first, entry.second));
+        rows.push_back({"swept", dayText(s.sweptThrough)});
+        FileManager::writeFile(path(), rows);
+        s.ready = true;
+    }
+
+    static void recordLoan(int memberType, const string &publisher)
+    {
+        Counts delta;
+        delta.loans = 1;
+        record(memberType, publisher, delta);
+    }
+
+    static void recordReturn(int memberType, const string &publisher)
+    {
+        Counts delta;
+        delta.returns = 1;
+        record(memberType, publisher, delta);
+    }
+
+    static void recordReservation(int memberType, const string &publisher)
+    {
+        Counts delta;
+        delta.reservations = 1;
+        record(memberType, publisher, delta);
+    }
+
+    // Totals per day or month from one day to another, overall or by
+    // member type or publisher, read from the rollups alone. A process
+    // that has not opened them (such as a report run from cron next to a
+    // running desk) reads the file without rewriting it.
+    static void printTrends(int from, int to, bool monthly, const string &by, bool csv)
+    {
+        State &s = state();
+        lock_guard<mutex> lock(s.guard);
+        if (!s.ready && s.rows.empty() && !load(s))
+            throw runtime_error("No rollups yet; they are built when the program starts");
+
+        map<pair<string, string>, Counts> totals;
+        size_t read = 0;
+        for (auto it = s.rows.lower_bound(Key(from, numeric_limits<int>::min(), ""));
+             it != s.rows.end() && get<0>(it->first) <= to; ++it, ++read)
+        {
+            string period = dayText(get<0>(it->first));
+            if (monthly)
+                period.resize(7);
+            string group = by == "type" ? typeName(get<1>(it->first)) : by == "publisher" ? get<2>(it->first)
+                                                                                          : "";
+            totals[make_pair(period, group)].add(it->second);
+        }
+
+        string label = by.empty() ? "" : by == "type" ? "MemberType" : "Publisher";
+        if (csv)
+            cout << "Period" << (label.empty() ? "" : "," + label) << ",Loans,Returns,Reservations,Overdue\n";
+        else
+        {
+            cout << "\n" << left << setw(12) << "Period";
+            if (!label.empty())
+                cout << setw(24) << label;
+            cout << right << setw(8) << "Loans" << setw(9) << "Returns" << setw(14) << "Reservations"
+                 << setw(9) << "Overdue" << "\n";
+        }
+        for (auto &entry : totals)
+        {
+            const Counts &c = entry.second;
+            if (csv)
+            {
+                cout << entry.first.first << (label.empty() ? "" : "," + entry.first.second) << "," << c.loans
+                     << "," << c.returns << "," << c.reservations << "," << c.overdue << "\n";
+                continue;
+            }
+            cout << left << setw(12) << entry.first.first;
+            if (!label.empty())
+                cout << setw(24) << entry.first.second.substr(0, 23);
+            cout << right << setw(8) << c.loans << setw(9) << c.returns << setw(14) << c.reservations
+                 << setw(9) << c.overdue << "\n";
+        }
+        if (!csv)
+            cout << totals.size() << " row(s) summed from " << read << " rollup row(s)\n";
+    }
+};
+
+// "Due in 3 days" and "overdue" reminders for open loans. Both reminder
+// times of every open loan sit in a hierarchical timer wheel of one-minute
+// ticks, four levels of 64 slots each. A timer moves down a level at most
+// three times, so scheduling, cancelling and firing a reminder each cost
+// O(1) however many loans are out, and no tick reads the loan tables.
+// Reminders that fall due together go to the outbox as one batch file; the
+// watermark file holds the last minute handled, so a restart sends what
+// fell due while the program was down and, barring a crash between a
+// batch and its watermark, nothing twice.
+class DueReminders
+{
+private:
+    enum
+    {
+        Levels = 4,
+        SlotBits = 6,
+        Slots = 1 << SlotBits
+    };
+    static const int64_t Tick = 60;
+    static const int64_t NoticeDays = 3;
+
+    enum Kind
+    {
+        DueSoon,
+        Overdue
+    };
+
+    struct Timer
+    {
+        Kind kind = DueSoon;
+        size_t branch = 0;
+        string member;
+        string title;
+        uint64_t isbn = 0;
+        int64_t due = 0;
+        int64_t expires = 0; // tick
+        int prev = -1;
+        int next = -1;
+    };
+
+    struct Wheel
+    {
+        mutex guard;
+        vector<Timer> timers;
+        vector<int> unused;
+        int heads[Levels * Slots];
+        int64_t current = 0; // the next tick to process
+        unordered_map<string, pair<int, int>> byLoan; // due-soon and overdue timers
+        bool ready = false;
+
+        Wheel() { fill(heads, heads + Levels * Slots, -1); }
+    };
+
+    struct Worker
+    {
+        thread loop;
+        atomic<bool> running;
+        Worker() : running(false) {}
+    };
+
+    static Wheel &wheel()
+    {
+        static Wheel w;
+        return w;
+    }
+
+    static Worker &worker()
+    {
+        static Worker w;
+        return w;
+    }
+
+    static const char *outbox() { return "outbox"; }
+    static string watermarkPath() { return string(outbox()) + "/watermark"; }
+
+    static string loanKey(size_t branch, const string &member, uint64_t isbn, int64_t due)
+    {
+        return to_string(branch) + "|" + member + "|" + to_string(isbn) + "|" + to_string(due);
+    }
+
+    // The slot for a timer, relative to the next tick: level 0 holds the
+    // next 64 ticks one per slot, each level above 64 times the span of
+    // the one below. Past timers fire on the next tick; timers beyond the
+    // top level wait in its last slot and are placed again when it cascades.
+    static int slotOf(const Wheel &w, int64_t expires)
+    {
+        int64_t delta = expires - w.current;
+        if (delta < 0)
+            expires = w.current;
+        int level = 0;
+        while (level < Levels - 1 && delta >= (int64_t)1 << (SlotBits * (level + 1)))
+            ++level;
+        if (delta >= (int64_t)1 << (SlotBits * Levels))
+            expires = w.current + ((int64_t)1 << (SlotBits * Levels)) - 1;
+        return level * Slots + (int)((expires >> (SlotBits * level)) & (Slots - 1));
+    }
+
+    static void link(Wheel &w, int id)
+    {
+        Timer &t = w.timers[id];
+        int slot = slotOf(w, t.expires);
+        t.prev = -(slot + 2); // a slot head points back at its slot
+        t.next = w.heads[slot];
+        if (t.next >= 0)
+            w.timers[t.next].prev = id;
+        w.heads[slot] = id;
+    }
+
+    static void unlink(Wheel &w, int id)
+    {
+        Timer &t = w.timers[id];
+        if (t.prev >= 0)
+            w.timers[t.prev].next = t.next;
+        else
+            w.heads[-(t.prev + 2)] = t.next;
+        if (t.next >= 0)
+            w.timers[t.next].prev = t.prev;
+    }
+
+    static int add(Wheel &w, Kind kind, size_t branch, const string &member, const string &title,
+                   uint64_t isbn, int64_t due, int64_t fireAt)
+    {
+        int64_t expires = (fireAt + Tick - 1) / Tick;
+        if (expires < w.current)
+            return -1; // handled before the watermark
+        int id;
+        if (w.unused.empty())
+        {
+            id = w.timers.size();
+            w.timers.emplace_back();
+        }
+        else
+        {
+            id = w.unused.back();
+            w.unused.pop_back();
+        }
+        Timer &t = w.timers[id];
+        t.kind = kind;
+        t.branch = branch;
+        t.member = member;
+        t.title = title;
+        t.isbn = isbn;
+        t.due = due;
+        t.expires = expires;
+        link(w, id);
+        return id;
+    }
+
+    static void release(Wheel &w, int id)
+    {
+        unlink(w, id);
+        Timer &t = w.timers[id];
+        string().swap(t.member);
+        string().swap(t.title);
+        w.unused.push_back(id);
+    }
+
+    // Schedules both reminders of a loan; the due-soon one only when the
+    // loan was issued before its notice period
+    static void addLoan(Wheel &w, size_t branch, const string &member, const string &title, uint64_t isbn,
+                        int64_t issued, int64_t due)
+    {
+        int64_t notice = due - NoticeDays * 86400;
+        int soon = notice > issued ? add(w, DueSoon, branch, member, title, isbn, due, notice) : -1;
+        int late = add(w, Overdue, branch, member, title, isbn, due, due);
+        if (soon >= 0 || late >= 0)
+            w.byLoan[loanKey(branch, member, isbn, due)] = make_pair(soon, late);
+    }
+
+    // Re-places every timer of a higher-level slot one level down or lower
+    static void cascade(Wheel &w, int level)
+    {
+        int slot = level * Slots + (int)((w.current >> (SlotBits * level)) & (Slots - 1));
+        int id = w.heads[slot];
+        w.heads[slot] = -1;
+        while (id >= 0)
+        {
+            int next = w.timers[id].next;
+            link(w, id);
+            id = next;
+        }
+    }
+
+    // Fires every tick up to and including the given one
+    static void advance(Wheel &w, int64_t through, vector<Timer> &fired)
+    {
+        while (w.current <= through)
+        {
+            int index = (int)(w.current & (Slots - 1));
+            for (int level = 1; index == 0 && level < Levels; ++level)
+            {
+                cascade(w, level);
+                if ((w.current >> (SlotBits * level)) & (Slots - 1))
+                    break;
+            }
+
+            for (int id = w.heads[index]; id >= 0;)
+            {
+                Timer &t = w.timers[id];
+                int next = t.next;
+                auto loan = w.byLoan.find(loanKey(t.branch, t.member, t.isbn, t.due));
+                if (loan != w.byLoan.end())
+                {
+                    (t.kind == DueSoon ? loan->second.first : loan->second.second) = -1;
+                    if (loan->second.first < 0 && loan->second.second < 0)
+                        w.byLoan.erase(loan);
+                }
+                fired.push_back(t);
+                release(w, id);
+                id = next;
+            }
+            ++w.current;
+        }
+    }
+
+    // One outbox file per batch, named after its last tick and renamed into
+    // place complete, so the relay never sees half a batch
+    static void send(const vector<Timer> &batch, int64_t lastTick)
+    {
+        time_t at = lastTick * Tick;
+        tm utc;
+        gmtime_r(&at, &utc);
+        char name[32];
+        strftime(name, sizeof(name), "%Y%m%d-%H%M", &utc);
+
+        TableVersion::Rows rows;
+        rows.push_back({"Kind", "MemberID", "ISBN", "Title", "Due", "Branch"});
+        for (const Timer &t : batch)
+        {
+            time_t due = t.due;
+            tm local;
+            localtime_r(&due, &local);
+            char date[16];
+            strftime(date, sizeof(date), "%d/%m/%Y", &local);
+            rows.push_back({t.kind == DueSoon ? "DUE_SOON" : "OVERDUE", t.member, Isbn::format(t.isbn), t.title,
+                            date, Branches::all()[t.branch].name});
+        }
+        FileManager::writeFile(string(outbox()) + "/reminders-" + name + ".csv", rows);
+    }
+
+    // Fires the ticks that have passed, sends them as one batch and moves
+    // the watermark past them
+    static void tick(time_t now)
+    {
+        Wheel &w = wheel();
+        vector<Timer> fired;
+        int64_t last;
+        {
+            lock_guard<mutex> lock(w.guard);
+            if (!w.ready || now / Tick < w.current)
+                return;
+            advance(w, now / Tick, fired);
+            last = w.current - 1;
+        }
+        if (!fired.empty())
+            send(fired, last);
+        FileManager::writeFile(watermarkPath(), {{to_string(last * Tick)}});
+    }
+
+public:
+    // Fills the wheel from every branch's open loans, sends what fell due
+    // since the watermark and starts the minute ticker. Without a
+    // watermark, reminding starts from now.
+    static void start()
+    {
+        if (mkdir(outbox(), 0755) != 0 && errno != EEXIST)
+            throw runtime_error(string("Cannot create ") + outbox() + ": " + strerror(errno));
+        time_t now = time(0);
+        int64_t watermark = now - Tick;
+        ifstream(watermarkPath()) >> watermark;
+
+        Wheel &w = wheel();
+        {
+            lock_guard<mutex> lock(w.guard);
+            w.current = watermark / Tick + 1;
+            auto snapshot = FileManager::pin();
+            for (size_t b = 0; b < Branches::count(); ++b)
+            {
+                auto loans = snapshot->table(Branches::pathIn(b, "transactions.csv"));
+                auto columns = columnsOf<LoanColumns>(loans);
+                ColumnScan::forEachSet(columns->active.data(), columns->active.size(), [&](size_t i)
+                                       {
+                    const auto &trans = loans->row(i);
+                    addLoan(w, b, trans[0], trans[1], loans->isbnAt(i), columns->issued[i], columns->due[i]); });
+            }
+            w.ready = true;
+        }
+        tick(now);
+
+        Worker &ticker = worker();
+        ticker.running = true;
+        ticker.loop = thread([]()
+                             {
+            while (worker().running)
+            {
+                this_thread::sleep_for(chrono::milliseconds(100));
+                tick(time(0));
+            } });
+    }
+
+    static void stop()
+    {
+        Worker &w = worker();
+        if (!w.running)
+            return;
+        w.running = false;
+        w.loop.join();
+        tick(time(0));
+    }
+
+    // A new loan in the current branch
+    static void schedule(const string &member, const string &title, uint64_t isbn, time_t issued, time_t due)
+    {
+        Wheel &w = wheel();
+        lock_guard<mutex> lock(w.guard);
+        if (w.ready)
+            addLoan(w, Branches::current(), member, title, isbn, issued, due);
+    }
+
+    // A loan of the current branch closed before its reminders fired
+    static void cancel(const string &member, uint64_t isbn, time_t due)
+    {
+        Wheel &w = wheel();
+        lock_guard<mutex> lock(w.guard);
+        auto loan = w.byLoan.find(loanKey(Branches::current(), member, isbn, due));
+        if (loan == w.byLoan.end())
+            return;
+        if (loan->second.first >= 0)
+            release(w, loan->second.first);
+        if (loan->second.second >= 0)
+            release(w, loan->second.second);
+        w.byLoan.erase(loan);
+    }
+};
+
+// Loans of one branch's books issued at another branch's desk. The loan row
+// stays in the owning branch's transactions.csv, beside the copy's
+// availability; interbranch.csv in the shared directory only records the
+// movement (ISBN,UserID,OwnerBranch,DeskBranch,Time,Event), with an OUT
+// event when the loan is issued and a RETURN event when it ends, so no
+// branch copies another's tables.
+class InterBranchLoans
+{
+private:
+    // The OUT row of every loan still away from its branch, by
+    // ISBN, member and owning branch
+    static map<tuple<string, string, string>, vector<string>> open()
+    {
+        map<tuple<string, string, string>, vector<string>> loans;
+        FileManager fm(FileManager::pin());
+        fm.loadFile("interbranch.csv");
+        for (auto &row : fm.getData())
+        {
+            if (row.size() < 6)
+                continue;
+            auto key = make_tuple(row[0], row[1], row[2]);
+            if (row[5] == "OUT")
+                loans[key] = row;
+            else
+                loans.erase(key);
+        }
+        return loans;
+    }
+
+public:
+    static void record(const string &event, uint64_t isbn, const string &memberId, size_t owner, size_t desk)
+    {
+        FileManager fm;
+        fm.appendRecord({Isbn::format(isbn), memberId, Branches::all()[owner].id, Branches::all()[desk].id,
+                         to_string(time(0)), event},
+                        "interbranch.csv");
+    }
+
+    static bool isOut(uint64_t isbn, const string &memberId, size_t owner)
+    {
+        if (!Branches::sharded())
+            return false;
+        return open().count(make_tuple(Isbn::format(isbn), memberId, Branches::all()[owner].id)) > 0;
+    }
+
+    static void show()
+    {
+        auto loans = open();
+        if (loans.empty())
+        {
+            cout << "No inter-branch loans.\n";
+            return;
+        }
+        cout << "\nInter-Branch Loans:\n";
+        for (auto &entry : loans)
+        {
+            const auto &row = entry.second;
+            time_t issued = stol(row[4]);
+            cout << "User: " << row[1] << " | ISBN: " << row[0] << " | Owner: " << row[2]
+                 << " | Issued at: " << row[3] << " on " << put_time(localtime(&issued), "%d/%m/%Y") << "\n";
+        }
+    }
+};
+
+// Records what desk and kiosk sessions type, one tab-separated line per
+// input: session, milliseconds since the session began, field and value.
+// The code that reads a value says what it is with a Scope around the read;
+// anything read outside one is recorded as typed. Secrets are never
+// written. When anonymising, User IDs, ISBNs and names are replaced by
+// pseudonyms salted per recording, which only the holder of the data files
+// can map back (the replayer does so).
+class SessionRecorder
+{
+public:
+    // What a value read from the session is
+    enum Kind
+    {
+        Plain,
+        Secret,   // passwords
+        Personal, // names
+        UserId,
+        BookIsbn
+    };
+
+    // The recording state of one session: its id (0 when not recording),
+    // its start, and the kind of value being read
+    struct Tap
+    {
+        uint64_t session = 0;
+        chrono::steady_clock::time_point start;
+        Kind kind = Plain;
+
+        void input(const string &line)
+        {
+            if (session)
+                record(*this, line);
+        }
+    };
+
+    // The tap of the session running on this thread; the console desk and
+    // the kiosk server set it while a recorded session runs, so other
+    // threads (branch fan-out workers) record into none
+    static Tap *&active()
+    {
+        static thread_local Tap *tap = nullptr;
+        return tap;
+    }
+
+    // Declares the kind of the values read while it is alive
+    class Scope
+    {
+    private:
+        Tap *tap;
+        Kind saved;
+
+    public:
+        explicit Scope(Kind kind) : tap(active()), saved(Plain)
+        {
+            if (tap)
+            {
+                saved = tap->kind;
+                tap->kind = kind;
+            }
+        }
+        ~Scope()
+        {
+            if (tap)
+                tap->kind = saved;
+        }
+    };
+
+    static void open(const string &path, bool anonymise)
+    {
+        State &s = state();
+        lock_guard<mutex> lock(s.guard);
+        s.file.open(path, ios::app);
+        if (!s.file)
+            throw runtime_error("Cannot open recording " + path);
+        s.anonymise = anonymise;
+        if (anonymise)
+        {
+            random_device seed;
+            ostringstream salt;
+            salt << hex << seed() << seed() << seed() << seed();
+            s.salt = salt.str();
+        }
+        s.file << "#recording" << (anonymise ? " salt=" + s.salt : "") << "\n";
+        s.file.flush();
+    }
+
+    static void begin(Tap &tap)
+    {
+        State &s = state();
+        lock_guard<mutex> lock(s.guard);
+        if (!s.file.is_open())
+            return;
+        tap.session = ++s.sessions;
+        tap.start = chrono::steady_clock::now();
+    }
+
+    // The field written for a kind of value
+    static string field(Kind kind)
+    {
+        switch (kind)
+        {
+        case Secret:
+            return "password";
+        case Personal:
+            return "name";
+        case UserId:
+            return "user";
+        case BookIsbn:
+            return "isbn";
+        default:
+            return "-";
+        }
+    }
+
+    static string pseudonym(const string &salt, const string &field, const string &value)
+    {
+        string text = value;
+        if (field == "isbn")
+        {
+            uint64_t key = Isbn::pack(value);
+            if (key == 0)
+                return value;
+            text = Isbn::format(key);
+        }
+        ostringstream out;
+        out << field[0] << hex << setw(12) << setfill('0')
+            << (KeyFilters::userHash(salt + "|" + text) >> 16);
+        return out.str();
+    }
+
+private:
+    struct State
+    {
+        mutex guard;
+        ofstream file;
+        bool anonymise = false;
+        string salt;
+        uint64_t sessions = 0;
+    };
+
+    static State &state()
+    {
+        static State s;
+        return s;
+    }
+
+    static void record(const Tap &tap, string line)
+    {
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+            line.pop_back();
+        string kind = field(tap.kind);
+        long long offset = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - tap.start).count();
+        State &s = state();
+        lock_guard<mutex> lock(s.guard);
+        if (tap.kind == Secret)
+            line = "*";
+        else if (s.anonymise && tap.kind != Plain && !line.empty() && line != "*")
+            line = pseudonym(s.salt, kind, line);
+        s.file << tap.session << "\t" << offset << "\t" << kind << "\t" << line << "\n";
+        s.file.flush();
+    }
+};
+
+// Read-only views over the tables, shared by librarians and read replicas.
+// Each one pins a snapshot, so it sees every table at the same point in
+// time however long it runs.
+class LibraryReports
+{
+public:
+    // Titles by ISBN, for rows that keep only the ISBN. Leaves the catalogue
+    // loaded and indexed in fm.
+    static unordered_map<uint64_t, string> titlesOf(FileManager &fm)
+    {
+        unordered_map<uint64_t, string> titles;
+        fm.loadFile("books.csv");
+        for (size_t i = 0; i < fm.getData().size(); ++i)
+            titles.insert(make_pair(fm.isbnAt(i), fm.getData()[i][0]));
+        return titles;
+    }
+
+    // Up to three other catalogue books borrowed by readers of this one
+    static void printAlsoBorrowed(ostream &out, uint64_t key, const unordered_map<uint64_t, string> &titles)
+    {
+        string line;
+        int shown = 0;
+        for (auto &neighbour : CoBorrowIndex::top(key, 8))
+        {
+            auto title = titles.find(neighbour.first);
+            if (title == titles.end())
+                continue;
+            line += (shown ? "; " : "") + title->second;
+            if (++shown == 3)
+                break;
+        }
+        if (shown > 0)
+            out << "   Readers also borrowed: " << line << "\n";
+    }
+
+    static void searchCatalogue()
+    {
+        string query;
+        cout << "Enter title, author, publisher or ISBN: ";
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        getline(cin, query);
+        uint64_t key = Isbn::pack(query);
+
+        string needle = query;
+        transform(needle.begin(), needle.end(), needle.begin(), ::tolower);
+
+        // Every branch searches its own catalogue on its own thread
+        auto snapshot = FileManager::pin();
+        auto found = Branches::fanOut<vector<string>>([&](size_t branch)
+                                                      {
+            FileManager fm(snapshot);
+            auto titles = titlesOf(fm);
+            vector<string> results;
+            for (size_t i = 0; i < fm.getData().size(); ++i)
+            {
+                const auto &book = fm.getData()[i];
+                bool match = key != 0 && fm.isbnAt(i) == key;
+                for (size_t field : {0, 1, 3})
+                {
+                    string text = book[field];
+                    transform(text.begin(), text.end(), text.begin(), ::tolower);
+                    match |= !needle.empty() && text.find(needle) != string::npos;
+                }
+                if (match)
+                {
+                    ostringstream out;
+                    out << Branches::tag(branch) << book[0] << " by " << book[1]
+                        << " (ISBN: " << book[2] << ") - "
+                        << (book[4] == "0" ? "Available" : "On loan") << "\n";
+                    printAlsoBorrowed(out, fm.isbnAt(i), titles);
+                    results.push_back(out.str());
+                }
+            }
+            return results; });
+
+        cout << "\nSearch Results:\n";
+        int count = 0;
+        for (auto &results : found)
+            for (auto &result : results)
+                cout << ++count << ". " << result;
+        if (count == 0)
+            cout << "No matching books.\n";
+    }
+
+    static void viewAllLoans()
+    {
+        auto snapshot = FileManager::pin();
+        auto lists = Branches::fanOut<string>([&](size_t branch)
+                                              {
+            auto table = snapshot->table("transactions.csv");
+            auto loans = columnsOf<LoanColumns>(table);
+            ostringstream out;
+            ColumnScan::forEachSet(loans->active.data(), loans->active.size(), [&](size_t i)
+                                   {
+                const auto &trans = table->row(i);
+                time_t dueDate = loans->due[i];
+                tm dt;
+                localtime_r(&dueDate, &dt);
+                out << Branches::tag(branch) << "User: " << trans[0] << " | Book: " << trans[1]
+                    << " (ISBN: " << trans[2] << ") | Due: "
+                    << put_time(&dt, "%d/%m/%Y") << "\n"; });
+            return out.str(); });
+
+        cout << "\nAll Active Loans:\n";
+        for (auto &list : lists)
+            cout << list;
+    }
+
+    static void showAvailableBooks()
+    {
+        auto snapshot = FileManager::pin();
+        auto found = Branches::fanOut<vector<string>>([&](size_t branch)
+                                                      {
+            auto table = snapshot->table("books.csv");
+            auto books = columnsOf<BookColumns>(table);
+            FileManager fm(snapshot);
+            auto titles = titlesOf(fm);
+            vector<string> results;
+            ColumnScan::forEachSet(books->available.data(), books->available.size(), [&](size_t i)
+                                   {
+                const auto &book = table->row(i);
+                ostringstream out;
+                out << Branches::tag(branch) << book[0]
+                    << " by " << book[1] << " (ISBN: " << book[2] << ")\n";
+                printAlsoBorrowed(out, fm.isbnAt(i), titles);
+                results.push_back(out.str()); });
+            return results; });
+
+        cout << "\nAvailable Books:\n";
+        int count = 1;
+        for (auto &results : found)
+            for (auto &result : results)
+                cout << count++ << ". " << result;
+    }
+
+    static void generateReports()
+    {
+        struct Counts
+        {
+            size_t books, available, loans, overdue, reservations;
+        };
+
+        auto snapshot = FileManager::pin();
+        time_t now = time(0);
+        FileManager fm(snapshot);
+        fm.loadFile("users.csv");
+        int totalUsers = fm.getData().size();
+
+        // Each branch counts its own tables; fines are per member across
+        // all branches, so they are accrued once
+        auto counts = Branches::fanOut<Counts>([&](size_t)
+                                               {
+            Counts c;
+            auto books = columnsOf<BookColumns>(snapshot->table("books.csv"));
+            c.books = books->rows;
+            c.available = ColumnScan::popcount(books->available.data(), books->available.size());
+
+            auto loans = columnsOf<LoanColumns>(snapshot->table("transactions.csv"));
+            c.loans = ColumnScan::popcount(loans->active.data(), loans->active.size());
+            vector<uint64_t> overdue = loans->overdue(now);
+            c.overdue = ColumnScan::popcount(overdue.data(), overdue.size());
+
+            c.reservations = snapshot->table("reservations.csv")->size();
+            return c; });
+        double totalFines = FineAccrual::run(*snapshot, now).total;
+
+        Counts total = {0, 0, 0, 0, 0};
+        for (auto &c : counts)
+        {
+            total.books += c.books;
+            total.available += c.available;
+            total.loans += c.loans;
+            total.overdue += c.overdue;
+            total.reservations += c.reservations;
+        }
+
+        cout << "\n=== Library Status Report ===\n"
+             << "Total Users: " << totalUsers << "\n"
+             << "Total Books: " << total.books << "\n"
+             << "Available Books: " << total.available << "\n"
+             << "Active Loans: " << total.loans << "\n"
+             << "Overdue Loans: " << total.overdue << "\n"
+             << "Active Reservations: " << total.reservations << "\n";
+        cout << "Estimated Outstanding Fines: ₹" << fixed << setprecision(2) << totalFines << "\n";
+
+        if (!Branches::sharded())
+            return;
+        cout << "\nBy branch:\n";
+        for (size_t b = 0; b < counts.size(); ++b)
+        {
+            const Counts &c = counts[b];
+            cout << Branches::all()[b].name << ": " << c.books << " books, " << c.available
+                 << " available, " << c.loans << " on loan, " << c.overdue << " overdue, "
+                 << c.reservations << " reserved\n";
+        }
+    }
+
+    static void viewUserLoans()
+    {
+        string userId;
+        cout << "Enter User ID to view loans: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::UserId);
+            cin >> userId;
+        }
+
+        FileManager fm(FileManager::pin());
+        cout << "\nLoan History for User: " << userId << "\n";
+        for (size_t b = 0; b < Branches::count(); ++b)
+        {
+            Branches::Scope scope(b);
+            fm.loadFile("transactions.csv");
+            for (auto &trans : fm.getData())
+            {
+                if (trans[0] == userId)
+                {
+                    time_t borrowDate = stol(trans[3]);
+                    time_t dueDate = stol(trans[4]);
+                    tm bdt, ddt;
+                    localtime_r(&borrowDate, &bdt);
+                    localtime_r(&dueDate, &ddt);
+
+                    cout << "- " << Branches::tag(b) << trans[1] << " (ISBN: " << trans[2] << ")\n"
+                         << "  Borrowed: " << put_time(&bdt, "%d/%m/%Y")
+                         << " | Due: " << put_time(&ddt, "%d/%m/%Y")
+                         << " | Status: " << (trans[5] == "0" ? "Active" : "Returned") << "\n";
+                }
+            }
+
+            auto titles = titlesOf(fm);
+            LoanArchive::scan(userId, numeric_limits<time_t>::min(), numeric_limits<time_t>::max(),
+                              [&](const LoanArchive::Loan &loan)
+                              { printArchived(loan, titles); });
+        }
+    }
+
+    // Archived loans borrowed in a date range, for one user or everyone
+    static void loanHistory()
+    {
+        string userId, fromText, toText;
+        cout << "Enter User ID (* for all): ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::UserId);
+            cin >> userId;
+        }
+        cout << "Borrowed from (dd/mm/yyyy): ";
+        cin >> fromText;
+        cout << "Borrowed to (dd/mm/yyyy): ";
+        cin >> toText;
+        if (userId == "*")
+            userId.clear();
+
+        time_t from = Dates::startOf(fromText), to = Dates::startOf(toText) + 86399;
+        FileManager fm(FileManager::pin());
+        size_t count = 0;
+        LoanArchive::ScanStats total;
+        cout << "\nArchived Loans:\n";
+        for (size_t b = 0; b < Branches::count(); ++b)
+        {
+            Branches::Scope scope(b);
+            auto titles = titlesOf(fm);
+            LoanArchive::ScanStats stats = LoanArchive::scan(userId, from, to, [&](const LoanArchive::Loan &loan)
+                                                             {
+                count++;
+                if (userId.empty())
+                    cout << loan.userId << " ";
+                printArchived(loan, titles); });
+            total.blocks += stats.blocks;
+            total.blocksRead += stats.blocksRead;
+            total.bytesRead += stats.bytesRead;
+            total.fileBytes += stats.fileBytes;
+        }
+        cout << count << " archived loan(s); read " << total.blocksRead << " of " << total.blocks
+             << " block(s), " << total.bytesRead << " of " << total.fileBytes << " bytes\n";
+    }
+
+private:
+    static void printArchived(const LoanArchive::Loan &loan, const unordered_map<uint64_t, string> &titles)
+    {
+        auto title = titles.find(loan.isbn);
+        tm borrowed, due;
+        localtime_r(&loan.borrowed, &borrowed);
+        localtime_r(&loan.due, &due);
+        cout << "- " << Branches::tag(Branches::current()) << (title != titles.end() ? title->second : "(no longer in catalogue)")
+             << " (ISBN: " << Isbn::format(loan.isbn) << ")\n"
+             << "  Borrowed: " << put_time(&borrowed, "%d/%m/%Y")
+             << " | Due: " << put_time(&due, "%d/%m/%Y")
+             << " | Status: " << (loan.returned ? "Returned" : "Active") << "\n";
+    }
+
+public:
+    // Writes one consistent version of every table to a directory while
+    // circulation carries on
+    static void exportSnapshot()
+    {
+        string dir;
+        cout << "Enter export directory: ";
+        cin >> dir;
+
+        auto snapshot = FileManager::pin();
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+            throw runtime_error("Cannot create directory " + dir);
+
+        FileManager fm(snapshot);
+        for (const string &name : FileManager::tablePaths())
+        {
+            // Branch tables keep their directory inside the export
+            size_t slash = name.rfind('/');
+            if (slash != string::npos && mkdir((dir + "/" + name.substr(0, slash)).c_str(), 0755) != 0 && errno != EEXIST)
+                throw runtime_error("Cannot create directory " + dir + "/" + name.substr(0, slash));
+            fm.loadFile(name);
+            ofstream file(dir + "/" + name);
+            for (auto &row : fm.getData())
+            {
+                for (size_t i = 0; i < row.size(); ++i)
+                    file << row[i] << (i + 1 < row.size() ? "," : "");
+                file << "\n";
+            }
+            if (!file)
+                throw runtime_error("Cannot write " + dir + "/" + name);
+        }
+        cout << "Exported snapshot at epoch " << snapshot->epoch << " to " << dir << "\n";
+    }
+};
+
+// A small query language over the four tables, for questions the fixed
+// views do not answer:
+//
+//   [EXPLAIN] SELECT * | column, ... | COUNT(*), SUM(column), ...
+//     FROM users | books | loans | reservations
+//     [WHERE column op value [AND ...]] [GROUP BY column]
+//     [LIMIT n] [INTO 'file.csv']
+//
+// op is one of = != < <= > >= or ~ (contains, ignoring case). Dates are
+// given as dd/mm/yyyy and compared by day; aggregates are COUNT, SUM, MIN,
+// MAX and AVG. Loans and reservations also carry the member's type and the
+// book's publisher, and loans the whole days they are overdue. The planner
+// answers an ISBN or User ID equality, or a due-date or overdue range, from
+// an index kept per table version; every predicate is applied inside the
+// scan, and large scans are split across threads. Rows stream out in table
+// order as each part of the scan completes.
+class QueryEngine
+{
+private:
+    enum Kind
+    {
+        Text,
+        Number,
+        Date
+    };
+
+    // Columns that are not a CSV field
+    enum Derived
+    {
+        MemberType = -1,
+        Publisher = -2,
+        OverdueDays = -3,
+        BranchId = -4
+    };
+
+    struct Column
+    {
+        string name;
+        int field;
+        Kind kind;
+    };
+
+    struct Predicate
+    {
+        size_t column;
+        string op;
+        string text;
+        double number;
+    };
+
+    struct Output
+    {
+        string aggregate; // empty for a plain column
+        int column;       // -1 for COUNT(*)
+    };
+
+    struct Query
+    {
+        bool explain = false;
+        string table;
+        vector<Output> outputs;
+        vector<Predicate> where;
+        int groupBy = -1;
+        size_t limit = 0;
+        string into;
+
+        bool aggregated() const
+        {
+            for (auto &o : outputs)
+            {
+                if (!o.aggregate.empty())
+                    return true;
+            }
+            return groupBy >= 0;
+        }
+    };
+
+    // One branch's copy of the table and the rows the plan reads from it
+    struct Source
+    {
+        size_t branch;
+        shared_ptr<const TableVersion> table;
+        bool all;
+        vector<uint32_t> rows;
+        size_t size() const { return all ? table->size() : rows.size(); }
+    };
+
+    struct Accumulator
+    {
+        double count = 0;
+        double sum = 0;
+        double min = numeric_limits<double>::max();
+        double max = numeric_limits<double>::lowest();
+    };
+
+    typedef map<string, vector<Accumulator>> Groups;
+
+    // One slice of a source, scanned by one thread
+    struct Task
+    {
+        size_t source;
+        size_t begin;
+        size_t end;
+        vector<vector<string>> rows;
+        Groups groups;
+        bool done;
+        exception_ptr error;
+    };
+
+    // Lookups for derived columns, built only when the query uses them
+    struct Context
+    {
+        const Query *query;
+        const vector<Column> *columns;
+        time_t now;
+        unordered_map<string, int> memberTypes;
+        vector<unordered_map<uint64_t, string>> publishers; // per branch
+    };
+
+    static const size_t taskRows = 65536;
+
+    static const vector<Column> &columns(const string &table)
+    {
+        static const map<string, vector<Column>> tables = {
+            {"users", {{"name", 0, Text}, {"user", 1, Text}, {"type", 3, Number}}},
+            {"books", {{"title", 0, Text}, {"author", 1, Text}, {"isbn", 2, Text}, {"publisher", 3, Text}, {"onloan", 4, Number}, {"reserved", 5, Number}, {"branch", BranchId, Text}}},
+            {"loans", {{"user", 0, Text}, {"title", 1, Text}, {"isbn", 2, Text}, {"borrowed", 3, Date}, {"due", 4, Date}, {"returned", 5, Number}, {"type", MemberType, Number}, {"publisher", Publisher, Text}, {"overdue", OverdueDays, Number}, {"branch", BranchId, Text}}},
+            {"reservations", {{"user", 0, Text}, {"title", 1, Text}, {"isbn", 2, Text}, {"reserved", 3, Date}, {"type", MemberType, Number}, {"publisher", Publisher, Text}, {"branch", BranchId, Text}}}};
+        auto it = tables.find(table);
+        if (it == tables.end())
+            throw runtime_error("Unknown table: " + table);
+        return it->second;
+    }
+
+    static string upper(string text)
+    {
+        transform(text.begin(), text.end(), text.begin(), ::toupper);
+        return text;
+    }
+
+    static string lower(string text)
+    {
+        transform(text.begin(), text.end(), text.begin(), ::tolower);
+        return text;
+    }
+
+    static size_t columnIndex(const vector<Column> &cols, const string &name)
+    {
+        for (size_t c = 0; c < cols.size(); ++c)
+        {
+            if (cols[c].name == lower(name))
+                return c;
+        }
+        throw runtime_error("Unknown column: " + name);
+    }
+
+    // Words, quoted strings (kept with their quotes), and operators
+    static vector<string> tokenize(const string &text)
+    {
+        vector<string> tokens;
+        size_t i = 0;
+        while (i < text.size())
+        {
+            char c = text[i];
+            if (isspace((unsigned char)c))
+                ++i;
+            else if (c == '\'' || c == '"')
+            {
+                size_t end = text.find(c, i + 1);
+                if (end == string::npos)
+                    throw runtime_error("Unterminated string in query");
+                tokens.push_back(text.substr(i, end - i + 1));
+                i = end + 1;
+            }
+            else if (strchr("(),*~=", c))
+                tokens.push_back(string(1, text[i++]));
+            else if (c == '<' || c == '>' || c == '!')
+            {
+                string op(1, c);
+                if (i + 1 < text.size() && text[i + 1] == '=')
+                    op += '=';
+                if (op == "!")
+                    throw runtime_error("Unknown operator: !");
+                tokens.push_back(op);
+                i += op.size();
+            }
+            else
+            {
+                size_t end = i;
+                while (end < text.size() && !isspace((unsigned char)text[end]) && !strchr("(),*~=<>!'\"", text[end]))
+                    ++end;
+                tokens.push_back(text.substr(i, end - i));
+                i = end;
+            }
+        }
+        return tokens;
+    }
+
+    static string unquote(const string &token)
+    {
+        if (token.size() >= 2 && (token[0] == '\'' || token[0] == '"'))
+            return token.substr(1, token.size() - 2);
+        return token;
+    }
+
+    class Parser
+    {
+    public:
+        explicit Parser(const string &text) : tokens(tokenize(text)), at(0) {}
+
+        bool done() const { return at >= tokens.size(); }
+        string peek() const { return done() ? "" : tokens[at]; }
+
+        string next()
+        {
+            if (done())
+                throw runtime_error("Query ends too early");
+            return tokens[at++];
+        }
+
+        bool accept(const string &word)
+        {
+            if (done() || upper(tokens[at]) != word)
+                return false;
+            ++at;
+            return true;
+        }
+
+        void expect(const string &word)
+        {
+            if (!accept(word))
+                throw runtime_error("Expected " + word + (done() ? " at the end" : " before '" + peek() + "'"));
+        }
+
+    private:
+        vector<string> tokens;
+        size_t at;
+    };
+
+    // Midnight at the start of a dd/mm/yyyy day, or a raw timestamp
+    static double dayStart(const string &value)
+    {
+        if (!value.empty() && value.find_first_not_of("0123456789") == string::npos)
+            return stod(value);
+        return (double)Dates::startOf(value);
+    }
+
+    static Query parse(const string &text)
+    {
+        Parser p(text);
+        Query q;
+        q.explain = p.accept("EXPLAIN");
+        p.expect("SELECT");
+
+        // Names are resolved once FROM gives the table
+        vector<pair<string, string>> selected;
+        do
+        {
+            string word = p.next();
+            string aggregate = upper(word);
+            bool known = aggregate == "COUNT" || aggregate == "SUM" || aggregate == "MIN" ||
+                         aggregate == "MAX" || aggregate == "AVG";
+            if (known && p.peek() == "(")
+            {
+                p.next();
+                string column = p.next();
+                p.expect(")");
+                selected.push_back(make_pair(aggregate, column));
+            }
+            else
+                selected.push_back(make_pair(string(), word));
+        } while (p.accept(","));
+
+        p.expect("FROM");
+        q.table = lower(p.next());
+        const vector<Column> &cols = columns(q.table);
+        for (auto &item : selected)
+        {
+            if (item.second == "*" && item.first.empty())
+            {
+                for (size_t c = 0; c < cols.size(); ++c)
+                    q.outputs.push_back({"", (int)c});
+            }
+            else if (item.second == "*" && item.first == "COUNT")
+                q.outputs.push_back({"COUNT", -1});
+            else
+            {
+                int column = (int)columnIndex(cols, item.second);
+                if (!item.first.empty() && item.first != "COUNT" && cols[column].kind == Text)
+                    throw runtime_error(item.first + " needs a numeric or date column");
+                q.outputs.push_back({item.first, column});
+            }
+        }
+
+        if (p.accept("WHERE"))
+        {
+            do
+            {
+                Predicate pred;
+                pred.column = columnIndex(cols, p.next());
+                pred.op = p.next();
+                if (pred.op != "=" && pred.op != "!=" && pred.op != "<" && pred.op != "<=" &&
+                    pred.op != ">" && pred.op != ">=" && pred.op != "~")
+                    throw runtime_error("Unknown operator: " + pred.op);
+                pred.text = unquote(p.next());
+                pred.number = 0;
+
+                const Column &c = cols[pred.column];
+                if (pred.op == "~")
+                    pred.text = lower(pred.text);
+                else if (c.kind == Date)
+                    pred.number = dayStart(pred.text);
+                else if (c.kind == Number)
+                {
+                    char *end;
+                    pred.number = strtod(pred.text.c_str(), &end);
+                    if (pred.text.empty() || *end)
+                        throw runtime_error("Not a number: " + pred.text);
+                }
+                else if (c.name == "isbn" && Isbn::pack(pred.text))
+                    pred.text = Isbn::format(Isbn::pack(pred.text));
+                q.where.push_back(pred);
+            } while (p.accept("AND"));
+        }
+
+        if (p.accept("GROUP"))
+        {
+            p.expect("BY");
+            q.groupBy = columnIndex(cols, p.next());
+        }
+        if (p.accept("LIMIT"))
+        {
+            string n = p.next();
+            if (n.empty() || n.find_first_not_of("0123456789") != string::npos)
+                throw runtime_error("LIMIT needs a number");
+            q.limit = stoul(n);
+        }
+        if (p.accept("INTO"))
+            q.into = unquote(p.next());
+        if (!p.done())
+            throw runtime_error("Unexpected '" + p.peek() + "' in query");
+
+        if (q.aggregated())
+        {
+            for (auto &o : q.outputs)
+            {
+                if (o.aggregate.empty() && o.column != q.groupBy)
+                    throw runtime_error("Only the GROUP BY column can be selected beside aggregates");
+            }
+        }
+
+        // Plain CSV fields are tested before columns that need a lookup
+        stable_partition(q.where.begin(), q.where.end(), [&cols](const Predicate &pred)
+                         { return cols[pred.column].field >= 0; });
+        return q;
+    }
+
+    static void value(const Context &ctx, const Column &c, const vector<string> &row, size_t branch,
+                      string &text, double &number)
+    {
+        switch (c.field)
+        {
+        case MemberType:
+        {
+            auto it = ctx.memberTypes.find(row.empty() ? "" : row[0]);
+            number = it != ctx.memberTypes.end() ? it->second : 0;
+            text = to_string((int)number);
+            return;
+        }
+        case Publisher:
+        {
+            const auto &books = ctx.publishers[branch];
+            auto it = books.find(row.size() > 2 ? Isbn::pack(row[2]) : 0);
+            text = it != books.end() ? it->second : "";
+            number = 0;
+            return;
+        }
+        case OverdueDays:
+        {
+            time_t due = row.size() > 4 ? atoll(row[4].c_str()) : 0;
+            bool open = row.size() > 5 && row[5] == "0";
+            number = open && due < ctx.now ? (double)((ctx.now - due) / 86400) : 0;
+            text = to_string((long long)number);
+            return;
+        }
+        case BranchId:
+            text = Branches::all()[branch].id;
+            number = 0;
+            return;
+        default:
+            text = (size_t)c.field < row.size() ? row[c.field] : "";
+            number = c.kind == Text ? 0 : atof(text.c_str());
+        }
+    }
+
+    static bool compare(const string &op, int cmp)
+    {
+        if (op == "=")
+            return cmp == 0;
+        if (op == "!=")
+            return cmp != 0;
+        if (op == "<")
+            return cmp < 0;
+        if (op == "<=")
+            return cmp <= 0;
+        if (op == ">")
+            return cmp > 0;
+        return cmp >= 0;
+    }
+
+    static bool matches(const Context &ctx, const Predicate &p, const vector<string> &row, size_t branch)
+    {
+        const Column &c = (*ctx.columns)[p.column];
+        string text;
+        double number;
+        value(ctx, c, row, branch, text, number);
+        if (p.op == "~")
+            return lower(text).find(p.text) != string::npos;
+        if (c.kind == Text)
+            return compare(p.op, text.compare(p.text));
+        if (c.kind == Date)
+        {
+            // A date stands for its whole day
+            double day = p.number;
+            int cmp = number < day ? -1 : number >= day + 86400 ? 1 : 0;
+            return compare(p.op, cmp);
+        }
+        return compare(p.op, number < p.number ? -1 : number > p.number ? 1 : 0);
+    }
+
+    static string display(const Column &c, const string &text)
+    {
+        if (c.kind != Date || text.empty())
+            return text;
+        time_t at = atoll(text.c_str());
+        tm date;
+        localtime_r(&at, &date);
+        char buffer[16];
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d", &date);
+        return buffer;
+    }
+
+    static string formatNumber(double number)
+    {
+        ostringstream out;
+        if (number == (double)(long long)number)
+            out << (long long)number;
+        else
+            out << fixed << setprecision(2) << number;
+        return out.str();
+    }
+
+    // Narrows [from, to] (inclusive due timestamps) by the query's
+    // predicates on due or overdue; false if none constrain it
+    static bool dueRange(const Query &q, const vector<Column> &cols, time_t now, int64_t &from, int64_t &to)
+    {
+        bool ranged = false;
+        from = numeric_limits<int64_t>::min();
+        to = numeric_limits<int64_t>::max();
+        for (auto &p : q.where)
+        {
+            const string &name = cols[p.column].name;
+            int64_t day = (int64_t)p.number;
+            if (name == "due" && p.op != "!=" && p.op != "~")
+            {
+                if (p.op == "=" || p.op == ">=")
+                    from = max(from, day);
+                if (p.op == ">")
+                    from = max(from, day + 86400);
+                if (p.op == "=" || p.op == "<=")
+                    to = min(to, day + 86399);
+                if (p.op == "<")
+                    to = min(to, day - 1);
+                ranged = true;
+            }
+            // Whole days overdue: more than n means due at least n + 1 days ago
+            else if (name == "overdue" && (p.op == ">" || p.op == ">=") && p.number >= 0)
+            {
+                double days = p.op == ">" ? floor(p.number) + 1 : ceil(p.number);
+                if (days < 1)
+                    continue;
+                to = min(to, (int64_t)(now - (time_t)days * 86400));
+                ranged = true;
+            }
+        }
+        return ranged;
+    }
+
+    // Chooses how each branch's table is read: the rows an ISBN or User ID
+    // index gives for an equality, or the due-date order gives for a range,
+    // taking the fewest; a full scan when no index applies
+    static string plan(const Query &q, vector<Source> &sources, time_t now)
+    {
+        const vector<Column> &cols = columns(q.table);
+        string isbn, user;
+        for (auto &p : q.where)
+        {
+            if (p.op != "=")
+                continue;
+            if (cols[p.column].name == "isbn" && Isbn::pack(p.text))
+                isbn = p.text;
+            if (cols[p.column].name == "user")
+                user = p.text;
+        }
+        int64_t from, to;
+        bool ranged = q.table == "loans" && dueRange(q, cols, now, from, to);
+
+        set<string> paths;
+        for (auto &s : sources)
+        {
+            string path = "full scan";
+            s.all = true;
+            // An index that leaves most of the table to read is no better than a scan
+            auto consider = [&](const string &name, const vector<uint32_t> &rows)
+            {
+                if (rows.size() * 2 > s.table->size())
+                    return;
+                if (s.all || rows.size() < s.rows.size())
+                {
+                    s.all = false;
+                    s.rows = rows;
+                    path = name;
+                }
+            };
+
+            if (!isbn.empty())
+            {
+                consider("ISBN index", columnsOf<IsbnIndex>(s.table)->rowsOf(Isbn::pack(isbn)));
+            }
+            if (!user.empty())
+            {
+                auto byUser = [&](const unordered_map<string, vector<uint32_t>> &rows)
+                {
+                    auto it = rows.find(user);
+                    consider("User ID index", it != rows.end() ? it->second : vector<uint32_t>());
+                };
+                // User IDs are the second column of users.csv and the first elsewhere
+                if (q.table == "users")
+                    byUser(columnsOf<UserIndex<1>>(s.table)->rows);
+                else
+                    byUser(columnsOf<UserIndex<0>>(s.table)->rows);
+            }
+            if (ranged && (s.all || s.rows.size() > 0))
+            {
+                auto order = columnsOf<DueOrder>(s.table);
+                auto begin = lower_bound(order->rows.begin(), order->rows.end(), make_pair(from, (uint32_t)0));
+                auto end = from > to ? begin : upper_bound(begin, order->rows.end(), make_pair(to, numeric_limits<uint32_t>::max()));
+                vector<uint32_t> rows;
+                rows.reserve(end - begin);
+                for (auto it = begin; it != end; ++it)
+                    rows.push_back(it->second);
+                // Rows go back into table order, so results stream in it
+                sort(rows.begin(), rows.end());
+                consider("due-date index", rows);
+            }
+            paths.insert(path);
+        }
+
+        string description;
+        for (auto &path : paths)
+            description += (description.empty() ? "" : ", ") + path;
+        return description;
+    }
+
+    static void scan(const Context &ctx, const vector<Source> &sources, Task &task)
+    {
+        const Query &q = *ctx.query;
+        const vector<Column> &cols = *ctx.columns;
+        const Source &s = sources[task.source];
+        bool aggregated = q.aggregated();
+        string text;
+        double number;
+        for (size_t i = task.begin; i < task.end; ++i)
+        {
+            const auto &row = s.table->row(s.all ? i : s.rows[i]);
+            bool keep = true;
+            for (auto &p : q.where)
+            {
+                if (!matches(ctx, p, row, s.branch))
+                {
+                    keep = false;
+                    break;
+                }
+            }
+            if (!keep)
+                continue;
+
+            if (!aggregated)
+            {
+                vector<string> out;
+                for (auto &o : q.outputs)
+                {
+                    value(ctx, cols[o.column], row, s.branch, text, number);
+                    out.push_back(display(cols[o.column], text));
+                }
+                task.rows.push_back(out);
+                if (q.limit && task.rows.size() >= q.limit)
+                    break;
+                continue;
+            }
+
+            string key;
+            if (q.groupBy >= 0)
+            {
+                value(ctx, cols[q.groupBy], row, s.branch, text, number);
+                key = display(cols[q.groupBy], text);
+            }
+            vector<Accumulator> &accumulators = task.groups[key];
+            accumulators.resize(q.outputs.size());
+            for (size_t k = 0; k < q.outputs.size(); ++k)
+            {
+                const Output &o = q.outputs[k];
+                if (o.aggregate.empty())
+                    continue;
+                Accumulator &a = accumulators[k];
+                a.count++;
+                if (o.column < 0)
+                    continue;
+                value(ctx, cols[o.column], row, s.branch, text, number);
+                a.sum += number;
+                a.min = min(a.min, number);
+                a.max = max(a.max, number);
+            }
+        }
+    }
+
+    // Result rows go to the console, or to a CSV file with a header row
+    class Sink
+    {
+    public:
+        Sink(const string &path, const vector<string> &header) : path(path)
+        {
+            if (!path.empty())
+            {
+                file.open(path);
+                if (!file)
+                    throw runtime_error("Cannot write " + path);
+            }
+            write(header);
+        }
+
+        void write(const vector<string> &row)
+        {
+            ostream &out = path.empty() ? cout : file;
+            for (size_t i = 0; i < row.size(); ++i)
+                out << (i ? (path.empty() ? " | " : ",") : "") << row[i];
+            out << "\n";
+        }
+
+        void close()
+        {
+            if (path.empty())
+                return;
+            file.close();
+            if (!file)
+                throw runtime_error("Cannot write " + path);
+        }
+
+    private:
+        string path;
+        ofstream file;
+    };
+
+public:
+    static void run(const string &text)
+    {
+        auto start = chrono::steady_clock::now();
+        Query q = parse(text);
+        const vector<Column> &cols = columns(q.table);
+        auto snapshot = FileManager::pin();
+
+        static const map<string, string> files = {
+            {"users", "users.csv"}, {"books", "books.csv"}, {"loans", "transactions.csv"}, {"reservations", "reservations.csv"}};
+        vector<Source> sources;
+        size_t branches = q.table == "users" ? 1 : Branches::count();
+        for (size_t b = 0; b < branches; ++b)
+            sources.push_back({b, snapshot->table(Branches::pathIn(b, files.at(q.table))), true, {}});
+
+        Context ctx;
+        ctx.query = &q;
+        ctx.columns = &cols;
+        ctx.now = time(0);
+        string path = plan(q, sources, ctx.now);
+
+        // Lookups only for the derived columns the query touches
+        set<int> used;
+        for (auto &o : q.outputs)
+            used.insert(o.column >= 0 ? cols[o.column].field : 0);
+        for (auto &p : q.where)
+            used.insert(cols[p.column].field);
+        if (q.groupBy >= 0)
+            used.insert(cols[q.groupBy].field);
+        if (used.count(MemberType))
+        {
+            auto users = snapshot->table("users.csv");
+            for (size_t i = 0; i < users->size(); ++i)
+            {
+                const auto &user = users->row(i);
+                if (user.size() > 3)
+                    ctx.memberTypes[user[1]] = atoi(user[3].c_str());
+            }
+        }
+        ctx.publishers.resize(Branches::count());
+        if (used.count(Publisher))
+        {
+            for (size_t b = 0; b < Branches::count(); ++b)
+            {
+                auto books = snapshot->table(Branches::pathIn(b, "books.csv"));
+                for (size_t i = 0; i < books->size(); ++i)
+                {
+                    const auto &book = books->row(i);
+                    if (uint64_t key = book.size() > 3 ? Isbn::pack(book[2]) : 0)
+                        ctx.publishers[b].insert(make_pair(key, book[3]));
+                }
+            }
+        }
+
+        vector<Task> tasks;
+        size_t total = 0, candidates = 0;
+        for (size_t s = 0; s < sources.size(); ++s)
+        {
+            total += sources[s].table->size();
+            candidates += sources[s].size();
+            for (size_t begin = 0; begin < sources[s].size(); begin += taskRows)
+                tasks.push_back({s, begin, min(sources[s].size(), begin + taskRows), {}, {}, false, nullptr});
+        }
+        size_t workers = min(tasks.size(), (size_t)max(1u, thread::hardware_concurrency()));
+
+        ostringstream summary;
+        summary << "plan: " << q.table << " via " << path << ", " << candidates << " of " << total
+                << " row(s) to read, " << q.where.size() << " predicate(s) in the scan, "
+                << max(workers, (size_t)1) << " thread(s)";
+        if (q.explain)
+        {
+            cout << summary.str() << "\n";
+            return;
+        }
+
+        vector<string> header;
+        for (auto &o : q.outputs)
+        {
+            string name = o.column >= 0 ? cols[o.column].name : "*";
+            header.push_back(o.aggregate.empty() ? name : lower(o.aggregate) + "(" + name + ")");
+        }
+        Sink sink(q.into, header);
+
+        // Threads claim slices in table order; finished slices are written
+        // in that order while later ones are still being scanned
+        mutex m;
+        condition_variable ready;
+        atomic<size_t> nextTask(0);
+        atomic<bool> stop(false);
+        vector<thread> threads;
+        for (size_t w = 0; w < workers; ++w)
+        {
+            threads.push_back(thread([&]()
+                                     {
+                size_t t;
+                while (!stop && (t = nextTask++) < tasks.size())
+                {
+                    try
+                    {
+                        scan(ctx, sources, tasks[t]);
+                    }
+                    catch (...)
+                    {
+                        tasks[t].error = current_exception();
+                    }
+                    {
+                        lock_guard<mutex> lock(m);
+                        tasks[t].done = true;
+                    }
+                    ready.notify_all();
+                } }));
+        }
+
+        size_t written = 0;
+        Groups groups;
+        exception_ptr error;
+        for (size_t t = 0; t < tasks.size() && !error; ++t)
+        {
+            if (!q.aggregated() && q.limit && written >= q.limit)
+                break;
+            {
+                unique_lock<mutex> lock(m);
+                ready.wait(lock, [&]()
+                           { return tasks[t].done; });
+            }
+            error = tasks[t].error;
+            for (auto &row : tasks[t].rows)
+            {
+                if (q.limit && written >= q.limit)
+                    break;
+                sink.write(row);
+                written++;
+            }
+            tasks[t].rows.clear();
+            for (auto &group : tasks[t].groups)
+            {
+                vector<Accumulator> &merged = groups[group.first];
+                merged.resize(q.outputs.size());
+                for (size_t k = 0; k < merged.size(); ++k)
+                {
+                    merged[k].count += group.second[k].count;
+                    merged[k].sum += group.second[k].sum;
+                    merged[k].min = min(merged[k].min, group.second[k].min);
+                    merged[k].max = max(merged[k].max, group.second[k].max);
+                }
+            }
+        }
+        stop = true;
+        for (auto &worker : threads)
+            worker.join();
+        if (error)
+            rethrow_exception(error);
+
+        if (q.aggregated())
+        {
+            // With no GROUP BY there is one result row, even over no rows
+            if (q.groupBy < 0 && groups.empty())
+                groups[""].resize(q.outputs.size());
+            for (auto &group : groups)
+            {
+                if (q.limit && written >= q.limit)
+                    break;
+                vector<string> row;
+                for (size_t k = 0; k < q.outputs.size(); ++k)
+                {
+                    const Output &o = q.outputs[k];
+                    const Accumulator &a = group.second[k];
+                    if (o.aggregate.empty())
+                        row.push_back(group.first);
+                    else if (o.aggregate == "COUNT")
+                        row.push_back(formatNumber(a.count));
+                    else if (a.count == 0)
+                        row.push_back("");
+                    else if (o.aggregate == "SUM")
+                        row.push_back(formatNumber(a.sum));
+                    else if (o.aggregate == "AVG")
+                        row.push_back(formatNumber(a.sum / a.count));
+                    else
+                    {
+                        double v = o.aggregate == "MIN" ? a.min : a.max;
+                        row.push_back(cols[o.column].kind == Date ? display(cols[o.column], to_string((long long)v)) : formatNumber(v));
+                    }
+                }
+                sink.write(row);
+                written++;
+            }
+        }
+        sink.close();
+
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cout << written << " row(s)" << (q.into.empty() ? "" : " written to " + q.into) << " in " << fixed
+             << setprecision(1) << ms << " ms (" << summary.str() << ")\n";
+    }
+
+    // Reads one query at a librarian or replica desk; an empty line lists
+    // the tables and their columns
+    static void prompt()
+    {
+        string text;
+        cout << "Query (empty for help): ";
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        getline(cin, text);
+        if (text.find_first_not_of(" \t") != string::npos)
+        {
+            run(text);
+            return;
+        }
+
+        cout << "SELECT * | columns | COUNT(*), SUM(c), MIN(c), MAX(c), AVG(c) FROM table\n"
+             << "  [WHERE c op value AND ...] [GROUP BY c] [LIMIT n] [INTO 'file.csv']\n"
+             << "op: = != < <= > >= ~ (contains); dates as dd/mm/yyyy; EXPLAIN shows the plan\n";
+        for (const char *table : {"users", "books", "loans", "reservations"})
+        {
+            cout << table << ":";
+            for (auto &c : columns(table))
+                cout << " " << c.name;
+            cout << "\n";
+        }
+    }
+};
+
+class LibraryMember
+{
+protected:
+    string memberId;
+    string memberName;
+    string memberPassword;
+    int memberType;
+
+public:
+    virtual void displayMainMenu() = 0;
+    virtual ~LibraryMember() = default;
+
+    // Reads a menu choice, discarding a line that is not a number.
+    // Returns false once input is exhausted, so menus can end the session.
+    static bool readChoice(int &choice)
+    {
+        if (cin >> choice)
+            return true;
+        if (cin.eof())
+            return false;
+        cin.clear();
+        cin.ignore(numeric_limits<streamsize>::max(), '\n');
+        choice = -1;
+        return true;
+    }
+};
+
+// Circulation shared by every member type that can borrow; the differences
+// between roles live in their LoanPolicy
+class Borrower : public LibraryMember
+{
+protected:
+    const LoanPolicy &policy;
+
+    Borrower(const string &id, const string &name, const string &pwd, int type)
+        : policy(LoanPolicy::forType(type))
+    {
+        memberId = id;
+        memberName = name;
+        memberPassword = pwd;
+        memberType = type;
+    }
+
+    void borrowBook()
+    {
+        string reason = LoanPolicyEngine::checkBorrow(memberId, policy, time(0));
+        if (!reason.empty())
+        {
+            cout << reason << "\n";
+            return;
+        }
+
+        string isbn;
+        cout << "Enter ISBN: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::BookIsbn);
+            cin >> isbn;
+        }
+        uint64_t key = Isbn::require(isbn);
+
+        // The loan is issued by the branch holding a free copy, this
+        // desk's own branch first
+        size_t desk = Branches::current();
+        for (size_t branch : KeyFilters::branchesWithIsbn(key))
+        {
+            Branches::Scope scope(branch);
+            FileManager fm;
+            fm.loadFile("books.csv");
+            auto bookIt = fm.getData().end();
+            for (size_t row : fm.findIsbn(key))
+            {
+                if (fm.getData()[row][4] == "0")
+                {
+                    bookIt = fm.getData().begin() + row;
+                    break;
+                }
+            }
+            if (bookIt == fm.getData().end())
+                continue;
+
+            (*bookIt)[4] = "1";
+            string title = (*bookIt)[0];
+            string publisher = (*bookIt)[3];
+            fm.saveFile("books.csv");
+
+            time_t dueDate = time(0) + policy.loanDays * 86400;
+            vector<string> transaction = {
+                memberId,
+                title,
+                Isbn::format(key),
+                to_string(time(0)),
+                to_string(dueDate),
+                "0"};
+            fm.appendRecord(transaction, "transactions.csv");
+            DueReminders::schedule(memberId, title, key, stoll(transaction[3]), dueDate);
+            if (branch != desk)
+                InterBranchLoans::record("OUT", key, memberId, branch, desk);
+            LoanPolicyEngine::recordBorrow(memberId, dueDate);
+            CoBorrowIndex::recordBorrow(memberId, key);
+            CirculationRollups::recordLoan(memberType, publisher);
+            AuditLog::record(memberId, "BORROW", Isbn::format(key), "due " + to_string(dueDate));
+            cout << "Book borrowed successfully!\n";
+            if (branch != desk)
+                cout << "The copy comes from the " << Branches::all()[branch].name << " branch.\n";
+
+            FileManager catalogue(FileManager::pin());
+            LibraryReports::printAlsoBorrowed(cout, key, LibraryReports::titlesOf(catalogue));
+            return;
+        }
+        cout << "Book not available!\n";
+    }
+
+    void returnBook()
+    {
+        string isbn;
+        cout << "Enter ISBN to return: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::BookIsbn);
+            cin >> isbn;
+        }
+        uint64_t key = Isbn::require(isbn);
+
+        // Any desk takes back a loan from any branch; the loan is closed
+        // in the branch that issued it
+        size_t desk = Branches::current();
+        for (size_t branch : Branches::fromCurrent())
+        {
+            Branches::Scope scope(branch);
+            FileManager fm;
+            fm.loadFile("transactions.csv");
+            bool found = false;
+            time_t dueDate = 0;
+
+            for (size_t row : fm.findIsbn(key))
+            {
+                auto &trans = fm.getData()[row];
+                if (trans[0] == memberId && trans[5] == "0")
+                {
+                    trans[5] = "1";
+                    dueDate = stol(trans[4]);
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+                continue;
+
+            fm.saveFile("transactions.csv");
+            DueReminders::cancel(memberId, key, dueDate);
+            LoanPolicyEngine::recordReturn(memberId, dueDate);
+
+            fm.loadFile("books.csv");
+            string publisher;
+            for (size_t row : fm.findIsbn(key))
+            {
+                fm.getData()[row][4] = "0";
+                publisher = fm.getData()[row][3];
+            }
+            fm.saveFile("books.csv");
+            CirculationRollups::recordReturn(memberType, publisher);
+            if (branch != desk || InterBranchLoans::isOut(key, memberId, branch))
+                InterBranchLoans::record("RETURN", key, memberId, branch, desk);
+
+            float fine = policy.fineFor(dueDate, time(0));
+            ostringstream detail;
+            detail << "fine " << fixed << setprecision(2) << fine;
+            AuditLog::record(memberId, "RETURN", Isbn::format(key), detail.str());
+            cout << "Book returned successfully!\n";
+            if (branch != desk)
+                cout << "Please send the copy back to the " << Branches::all()[branch].name << " branch.\n";
+            if (fine > 0)
+                cout << "Late return fine: ₹" << fixed << setprecision(2) << fine << "\n";
+            return;
+        }
+        cout << "No active loan found for this book!\n";
+    }
+
+    void calculateFines()
+    {
+        double fines;
+        time_t asOf;
+        if (FineLedger::lookup(memberId, fines, asOf))
+        {
+            cout << "Outstanding fines: ₹" << fixed << setprecision(2) << fines
+                 << " (as of " << put_time(localtime(&asOf), "%d/%m/%Y %H:%M") << ")\n";
+            return;
+        }
+        const MemberLoanSummary &s = LoanPolicyEngine::summary(memberId, policy, time(0));
+        cout << "Outstanding fines: ₹" << fixed << setprecision(2) << s.accruedFines << "\n";
+    }
+
+    void reserveBook()
+    {
+        string isbn;
+        cout << "Enter ISBN to reserve: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::BookIsbn);
+            cin >> isbn;
+        }
+        uint64_t key = Isbn::require(isbn);
+
+        // Reserved in the branch holding a free copy, this desk's first
+        size_t desk = Branches::current();
+        for (size_t branch : KeyFilters::branchesWithIsbn(key))
+        {
+            Branches::Scope scope(branch);
+            FileManager fm;
+            fm.loadFile("books.csv");
+            auto bookIt = fm.getData().end();
+            for (size_t row : fm.findIsbn(key))
+            {
+                const auto &b = fm.getData()[row];
+                if (b[4] == "0" && b[5] == "0")
+                {
+                    bookIt = fm.getData().begin() + row;
+                    break;
+                }
+            }
+            if (bookIt == fm.getData().end())
+                continue;
+
+            (*bookIt)[5] = "1";
+            string title = (*bookIt)[0];
+            string publisher = (*bookIt)[3];
+            fm.saveFile("books.csv");
+
+            vector<string> reservation = {
+                memberId,
+                title,
+                Isbn::format(key),
+                to_string(time(0))};
+            fm.appendRecord(reservation, "reservations.csv");
+            CirculationRollups::recordReservation(memberType, publisher);
+            AuditLog::record(memberId, "RESERVE", Isbn::format(key));
+            cout << "Book reserved successfully!\n";
+            if (branch != desk)
+                cout << "The copy is held at the " << Branches::all()[branch].name << " branch.\n";
+            return;
+        }
+        cout << "Book not available for reservation!\n";
+    }
+
+    void showCurrentLoans()
+    {
+        FileManager fm;
+        cout << "\nCurrent Loans:\n";
+        for (size_t b = 0; b < Branches::count(); ++b)
+        {
+            fm.loadFile(Branches::pathIn(b, "transactions.csv"));
+            for (auto &trans : fm.getData())
+            {
+                if (trans[0] == memberId && trans[5] == "0")
+                {
+                    time_t dueDate = stol(trans[4]);
+                    tm *dt = localtime(&dueDate);
+                    cout << "- " << Branches::tag(b) << trans[1] << " (ISBN: " << trans[2]
+                         << ") Due: " << put_time(dt, "%d/%m/%Y") << "\n";
+                }
+            }
+        }
+    }
+};
+
+class Student : public Borrower
+{
+public:
+    Student(const string &id, const string &name, const string &pwd)
+        : Borrower(id, name, pwd, 1)
+    {
+    }
+    void displayMainMenu() override
+    {
+        while (true)
+        {
+            cout << "\nStudent Portal - " << memberName << "\n"
+                 << "1. View Available Books\n"
+                 << "2. View Current Loans\n"
+                 << "3. Borrow Book\n"
+                 << "4. Return Book\n"
+                 << "5. Check Fines\n"
+                 << "6. Reserve Book\n"
+                 << "7. Search Catalogue\n"
+                 << "8. Logout\n"
+                 << "Choice: ";
+
+            int choice;
+            if (!readChoice(choice))
+                return;
+
+            try
+            {
+                switch (choice)
+                {
+                case 1:
+                    LibraryReports::showAvailableBooks();
+                    break;
+                case 2:
+                    showCurrentLoans();
+                    break;
+                case 3:
+                    borrowBook();
+                    break;
+                case 4:
+                    returnBook();
+                    break;
+                case 5:
+                    calculateFines();
+                    break;
+                case 6:
+                    reserveBook();
+                    break;
+                case 7:
+                    LibraryReports::searchCatalogue();
+                    break;
+                case 8:
+                    return;
+                default:
+                    throw runtime_error("Invalid choice");
+                }
+            }
+            catch (const exception &e)
+            {
+                cerr << "Error: " << e.what() << endl;
+            }
+        }
+    }
+};
+
+class Faculty : public Borrower
+{
+public:
+    Faculty(const string &id, const string &name, const string &pwd)
+        : Borrower(id, name, pwd, 2)
     {
-        memberId = id;
-        memberName = name;
-        memberPassword = pwd;
-        memberType = 2;
     }
 
     void displayMainMenu() override
     {
-        while (true)
+        while (true)
+        {
+            cout << "\nFaculty Portal - " << memberName << "\n"
+                 << "1. View Available Books\n"
+                 << "2. View Current Loans\n"
+                 << "3. Borrow Book\n"
+                 << "4. Return Book\n"
+                 << "5. Reserve Book\n"
+                 << "6. Search Catalogue\n"
+                 << "7. Logout\n"
+                 << "Choice: ";
+
+            int choice;
+            if (!readChoice(choice))
+                return;
+
+            try
+            {
+                switch (choice)
+                {
+                case 1:
+                    LibraryReports::showAvailableBooks();
+                    break;
+                case 2:
+                    showCurrentLoans();
+                    break;
+                case 3:
+                    borrowBook();
+                    break;
+                case 4:
+                    returnBook();
+                    break;
+                case 5:
+                    reserveBook();
+                    break;
+                case 6:
+                    LibraryReports::searchCatalogue();
+                    break;
+                case 7:
+                    return;
+                default:
+                    throw runtime_error("Invalid choice");
+                }
+            }
+            catch (const exception &e)
+            {
+                cerr << "Error: " << e.what() << endl;
+            }
+        }
+    }
+};
+
+class Librarian : public LibraryMember
+{
+public:
+    Librarian(const string &id, const string &name, const string &pwd)
+    {
+        memberId = id;
+        memberName = name;
+        memberPassword = pwd;
+        memberType = 3;
+    }
+
+    void displayMainMenu() override
+    {
+        while (true)
+        {
+            cout << "\nLibrarian Portal - " << memberName << "\n"
+                 << "1. Add User\n"
+                 << "2. Update User\n"
+                 << "3. Remove User\n"
+                 << "4. Add Book\n"
+                 << "5. Update Book\n"
+                 << "6. Remove Book\n"
+                 << "7. View All Loans\n"
+                 << "8. View Reservations\n"
+                 << "9. Generate Reports\n"
+                 << "10. View User Loans\n"
+                 << "11. ISBN Integrity Check\n"
+                 << "12. Search Catalogue\n"
+                 << "13. Export Snapshot\n"
+                 << "14. Run Fine Accrual\n"
+                 << "15. Archive Closed Loans\n"
+                 << "16. Loan History\n"
+                 << "17. Audit Log Status\n"
+                 << "18. Inter-Branch Loans\n"
+                 << "19. Run Query\n"
+                 << "20. Circulation Trends\n"
+                 << "0. Logout\n"
+                 << "Choice: ";
+
+            int choice;
+            if (!readChoice(choice))
+                return;
+
+            try
+            {
+                switch (choice)
+                {
+                case 1:
+                    addUser();
+                    break;
+                case 2:
+                    updateUser();
+                    break;
+                case 3:
+                    removeUser();
+                    break;
+                case 4:
+                    addBook();
+                    break;
+                case 5:
+                    updateBook();
+                    break;
+                case 6:
+                    removeBook();
+                    break;
+                case 7:
+                    LibraryReports::viewAllLoans();
+                    break;
+                case 8:
+                    viewReservations();
+                    break;
+                case 9:
+                    LibraryReports::generateReports();
+                    break;
+                case 10:
+                    LibraryReports::viewUserLoans();
+                    break;
+                case 11:
+                    repairIsbns();
+                    break;
+                case 12:
+                    LibraryReports::searchCatalogue();
+                    break;
+                case 13:
+                    LibraryReports::exportSnapshot();
+                    break;
+                case 14:
+                    FineLedger::runAccrual();
+                    break;
+                case 15:
+                    archiveLoans();
+                    break;
+                case 16:
+                    LibraryReports::loanHistory();
+                    break;
+                case 17:
+                    AuditLog::showStatus();
+                    break;
+                case 18:
+                    InterBranchLoans::show();
+                    break;
+                case 19:
+                    QueryEngine::prompt();
+                    break;
+                case 20:
+                    circulationTrends();
+                    break;
+                case 0:
+                    return;
+                default:
+                    throw runtime_error("Invalid choice");
+                }
+            }
+            catch (const exception &e)
+            {
+                cerr << "Error: " << e.what() << endl;
+            }
+        }
+    }
+
+private:
+    void addUser()
+    {
+        vector<string> newUser(4);
+        cout << "Enter User Type (1-Student, 2-Faculty, 3-Librarian): ";
+        cin >> newUser[3];
+        cout << "Enter Name: ";
+        cin.ignore();
+        {
+            SessionRecorder::Scope field(SessionRecorder::Personal);
+            getline(cin, newUser[0]);
+        }
+        cout << "Enter User ID: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::UserId);
+            cin >> newUser[1];
+        }
+        cout << "Enter Password: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::Secret);
+            cin >> newUser[2];
+        }
+
+        FileManager fm;
+        fm.appendRecord(newUser, "users.csv");
+        KeyFilters::addUser(newUser[1]);
+        AuditLog::record(memberId, "ADD_USER", newUser[1], "type " + newUser[3]);
+        cout << "User added successfully!\n";
+    }
+
+    void updateUser()
+    {
+        string userId;
+        cout << "Enter User ID to update: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::UserId);
+            cin >> userId;
+        }
+        if (!KeyFilters::mayHaveUser(userId))
+            throw runtime_error("User not found");
+
+        auto hasId = [&userId](const vector<string> &u)
+        { return u[1] == userId; };
+        FileManager view(FileManager::pin());
+        view.loadFile("users.csv");
+        if (none_of(view.getData().begin(), view.getData().end(), hasId))
+            throw runtime_error("User not found");
+
+        cout << "Select field to update:\n"
+             << "1. Name\n2. Password\nChoice: ";
+        int field;
+        cin >> field;
+        if (field != 1 && field != 2)
+            throw runtime_error("Invalid field");
+
+        cout << "Enter new value: ";
+        string value;
+        cin.ignore();
+        {
+            SessionRecorder::Scope kind(field == 1 ? SessionRecorder::Personal : SessionRecorder::Secret);
+            getline(cin, value);
+        }
+
+        // Reading input can suspend a kiosk session, so the table is loaded
+        // only now and saved before anything else can run
+        FileManager fm;
+        fm.loadFile("users.csv");
+        auto userIt = find_if(fm.getData().begin(), fm.getData().end(), hasId);
+        if (userIt == fm.getData().end())
+            throw runtime_error("User not found");
+        (*userIt)[field == 1 ? 0 : 2] = value;
+        fm.saveFile("users.csv");
+        AuditLog::record(memberId, "UPDATE_USER", userId, field == 1 ? "name" : "password");
+        cout << "User updated successfully!\n";
+    }
+
+    void removeUser()
+    {
+        string userId;
+        cout << "Enter User ID to remove: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::UserId);
+            cin >> userId;
+        }
+        if (!KeyFilters::mayHaveUser(userId))
+            throw runtime_error("User not found!");
+
+        FileManager fm;
+
+        // Remove from users.csv
+        fm.loadFile("users.csv");
+        auto userIt = remove_if(fm.getData().begin(), fm.getData().end(),
+                                [&userId](const vector<string> &u)
+                                { return u[1] == userId; });
+
+        if (userIt != fm.getData().end())
+        {
+            size_t rows = fm.getData().end() - userIt;
+            fm.getData().erase(userIt, fm.getData().end());
+            fm.saveFile("users.csv");
+            KeyFilters::removeUser(userId, rows);
+            AuditLog::record(memberId, "REMOVE_USER", userId);
+            cout << "User removed from registry.\n";
+
+            // Members borrow and reserve in every branch
+            for (size_t b = 0; b < Branches::count(); ++b)
+            {
+                Branches::Scope scope(b);
+
+                // Handle related transactions
+                fm.loadFile("transactions.csv");
+                unordered_set<uint64_t> booksToReturn;
+                for (size_t i = 0; i < fm.getData().size(); ++i)
+                {
+                    auto &trans = fm.getData()[i];
+                    if (trans[0] == userId && trans[5] == "0")
+                    {
+                        trans[5] = "1";
+                        booksToReturn.insert(fm.isbnAt(i));
+                        DueReminders::cancel(userId, fm.isbnAt(i), stoll(trans[4]));
+                    }
+                }
+                fm.saveFile("transactions.csv");
+
+                // Update book availability
+                if (!booksToReturn.empty())
+                {
+                    fm.loadFile("books.csv");
+                    for (size_t i = 0; i < fm.getData().size(); ++i)
+                    {
+                        if (booksToReturn.count(fm.isbnAt(i)))
+                            fm.getData()[i][4] = "0";
+                    }
+                    fm.saveFile("books.csv");
+                    cout << Branches::tag(b) << "Associated books returned to inventory.\n";
+                }
+
+                // Remove reservations
+                fm.loadFile("reservations.csv");
+                fm.getData().erase(remove_if(fm.getData().begin(), fm.getData().end(),
+                                             [&userId](const vector<string> &r)
+                                             { return r[0] == userId; }),
+                                   fm.getData().end());
+                fm.saveFile("reservations.csv");
+            }
+            LoanPolicyEngine::invalidate();
+
+            cout << "User removed successfully!\n";
+        }
+        else
+        {
+            throw runtime_error("User not found!");
+        }
+    }
+
+    void addBook()
+    {
+        vector<string> newBook(6);
+        cout << "Enter Book Title: ";
+        cin.ignore();
+        getline(cin, newBook[0]);
+        cout << "Enter Author: ";
+        getline(cin, newBook[1]);
+        cout << "Enter ISBN: ";
         {
-            cout << "\nFaculty Portal - " << memberName << "\n"
-                 << "1. View Available Books\n"
-                 << "2. View Current Loans\n"
-                 << "3. Borrow Book\n"
-                 << "4. Return Book\n"
-                 << "5. Reserve Book\n"
-                 << "6. Logout\n"
-                 << "Choice: ";
+            SessionRecorder::Scope field(SessionRecorder::BookIsbn);
+            getline(cin, newBook[2]);
+        }
+        newBook[2] = Isbn::format(Isbn::require(newBook[2]));
+        cout << "Enter Publisher: ";
+        getline(cin, newBook[3]);
+        newBook[4] = "0";
+        newBook[5] = "0";
 
-            int choice;
-            cin >> choice;
+        FileManager fm;
+        fm.appendRecord(newBook, "books.csv");
+        KeyFilters::addIsbn(Isbn::pack(newBook[2]));
+        AuditLog::record(memberId, "ADD_BOOK", newBook[2], newBook[0]);
+        cout << "Book added successfully!\n";
+    }
 
-            try
+    void updateBook()
+    {
+        string isbn;
+        cout << "Enter ISBN to update: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::BookIsbn);
+            cin >> isbn;
+        }
+        uint64_t key = Isbn::require(isbn);
+        if (!KeyFilters::mayHaveIsbn(key))
+            throw runtime_error("Book not found!");
+
+        FileManager view(FileManager::pin());
+        view.loadFile("books.csv");
+        vector<size_t> rows = view.findIsbn(key);
+        if (rows.empty())
+            throw runtime_error("Book not found!");
+
+        const auto &book = view.getData()[rows.front()];
+        cout << "Current Details:\n"
+             << "1. Title: " << book[0] << "\n"
+             << "2. Author: " << book[1] << "\n"
+             << "3. Publisher: " << book[3] << "\n"
+             << "Enter field number to update (1-3): ";
+
+        int field;
+        cin >> field;
+        cin.ignore();
+
+        if (field < 1 || field > 3)
+        {
+            throw runtime_error("Invalid field selection");
+        }
+
+        cout << "Enter new value: ";
+        string value;
+        getline(cin, value);
+
+        // Reading input can suspend a kiosk session, so the catalogue is
+        // loaded again and saved before anything else can run
+        FileManager fm;
+        fm.loadFile("books.csv");
+        rows = fm.findIsbn(key);
+        if (rows.empty())
+            throw runtime_error("Book not found!");
+        const size_t columns[] = {0, 0, 1, 3};
+        fm.getData()[rows.front()][columns[field]] = value;
+        fm.saveFile("books.csv");
+
+        if (field == 1)
+        {
+            fm.loadFile("transactions.csv");
+            for (size_t row : fm.findIsbn(key))
+                fm.getData()[row][1] = value;
+            fm.saveFile("transactions.csv");
+        }
+
+        const char *fields[] = {"", "title", "author", "publisher"};
+        AuditLog::record(memberId, "UPDATE_BOOK", Isbn::format(key), fields[field]);
+        cout << "Book updated successfully!\n";
+    }
+
+    void removeBook()
+    {
+        string isbn;
+        cout << "Enter ISBN to remove: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::BookIsbn);
+            cin >> isbn;
+        }
+        uint64_t key = Isbn::require(isbn);
+        if (!KeyFilters::mayHaveIsbn(key))
+            throw runtime_error("Book not found!");
+
+        FileManager fm;
+
+        fm.loadFile("books.csv");
+        size_t copies = eraseIsbn(fm, key);
+        if (copies > 0)
+        {
+            fm.saveFile("books.csv");
+            KeyFilters::removeIsbn(key, copies);
+            AuditLog::record(memberId, "REMOVE_BOOK", Isbn::format(key), to_string(copies) + " copies");
+            cout << "Book removed from catalog.\n";
+
+            fm.loadFile("transactions.csv");
+            eraseIsbn(fm, key);
+            fm.saveFile("transactions.csv");
+            LoanPolicyEngine::invalidate();
+
+            fm.loadFile("reservations.csv");
+            eraseIsbn(fm, key);
+            fm.saveFile("reservations.csv");
+
+            cout << "Associated records cleaned up.\n";
+        }
+        else
+        {
+            throw runtime_error("Book not found!");
+        }
+    }
+
+    // Removes every loaded row whose ISBN column packs to key
+    static size_t eraseIsbn(FileManager &fm, uint64_t key)
+    {
+        vector<vector<string>> kept;
+        kept.reserve(fm.getData().size());
+        for (size_t i = 0; i < fm.getData().size(); ++i)
+        {
+            if (fm.isbnAt(i) != key)
+                kept.push_back(move(fm.getData()[i]));
+        }
+        size_t removed = fm.getData().size() - kept.size();
+        fm.getData().swap(kept);
+        return removed;
+    }
+
+    void repairIsbns()
+    {
+        FileManager view(FileManager::pin());
+        view.loadFile("books.csv");
+        const auto &books = view.getData();
+
+        // Group rows by the value they are looked up with: the packed key for
+        // valid ISBNs, the raw text for invalid ones
+        map<string, vector<size_t>> groups;
+        for (size_t i = 0; i < books.size(); ++i)
+        {
+            uint64_t key = view.isbnAt(i);
+            groups[key ? Isbn::format(key) : books[i][2]].push_back(i);
+        }
+
+        // Each edit is the row's old ISBN text and title, and its new ISBN
+        typedef pair<pair<string, string>, string> Edit;
+        vector<Edit> normalized;
+        vector<size_t> flagged;
+        cout << "\n=== ISBN Integrity Check ===\n";
+        for (auto &group : groups)
+        {
+            bool valid = view.isbnAt(group.second.front()) != 0;
+            bool collision = false;
+            for (size_t row : group.second)
+                collision |= books[row][0] != books[group.second.front()][0];
+
+            for (size_t row : group.second)
             {
-                switch (choice)
+                if (!valid)
                 {
-                case 1:
-                    showAvailableBooks();
-                    break;
-                case 2:
-                    showCurrentLoans();
-                    break;
-                case 3:
-                    borrowBook();
-                    break;
-                case 4:
-                    returnBook();
-                    break;
-                case 5:
-                    reserveBook();
-                    break;
-                case 6:
-                    return;
-                default:
-                    throw runtime_error("Invalid choice");
+                    cout << "Invalid ISBN '" << books[row][2] << "' for \"" << books[row][0] << "\""
+                         << (Isbn::isMangled(books[row][2]) ? " (spreadsheet exponent notation)" : "")
+                         << (collision ? " - collides with " + to_string(group.second.size() - 1) + " other book(s)" : "")
+                         << "\n";
+                    flagged.push_back(row);
+                }
+                else if (collision)
+                {
+                    cout << "ISBN " << group.first << " is shared by different titles: \""
+                         << books[row][0] << "\"\n";
+                    flagged.push_back(row);
                 }
+                else if (books[row][2] != group.first)
+                    normalized.push_back(Edit(make_pair(books[row][2], books[row][0]), group.first));
             }
-            catch (const exception &e)
+        }
+
+        sort(flagged.begin(), flagged.end());
+        cout << flagged.size() << " book(s) flagged, " << normalized.size() << " ISBN(s) normalized.\n";
+
+        vector<Edit> renames;
+        string answer;
+        if (!flagged.empty())
+        {
+            cout << "Enter corrected ISBNs now? (y/n): ";
+            cin >> answer;
+            cin.ignore();
+        }
+        if (answer == "y" || answer == "Y")
+        {
+            unordered_set<uint64_t> used;
+            for (size_t i = 0; i < books.size(); ++i)
+                if (view.isbnAt(i) != 0)
+                    used.insert(view.isbnAt(i));
+
+            for (size_t row : flagged)
             {
-                cerr << "Error: " << e.what() << endl;
+                cout << "Correct ISBN for \"" << books[row][0] << "\" (blank to skip): ";
+                string value;
+                getline(cin, value);
+                if (value.empty())
+                    continue;
+
+                uint64_t key = Isbn::pack(value);
+                if (key == 0)
+                {
+                    cout << "Invalid ISBN, skipped.\n";
+                    continue;
+                }
+                if (used.count(key) && key != view.isbnAt(row))
+                {
+                    cout << "ISBN already in use, skipped.\n";
+                    continue;
+                }
+                used.insert(key);
+                renames.push_back(Edit(make_pair(books[row][2], books[row][0]), Isbn::format(key)));
+            }
+        }
+        if (normalized.empty() && renames.empty())
+            return;
+
+        // Reading input can suspend a kiosk session, so the edits are
+        // applied to the tables as they are now, each to the first row
+        // with its old ISBN text and title that is still unchanged
+        FileManager fm;
+        fm.loadFile("books.csv");
+        vector<bool> edited(fm.getData().size());
+        size_t repaired = 0;
+        for (const vector<Edit> *edits : {&normalized, &renames})
+        {
+            for (const Edit &edit : *edits)
+            {
+                for (size_t i = 0; i < fm.getData().size(); ++i)
+                {
+                    auto &book = fm.getData()[i];
+                    if (!edited[i] && book[2] == edit.first.first && book[0] == edit.first.second)
+                    {
+                        book[2] = edit.second;
+                        edited[i] = true;
+                        repaired += edits == &renames;
+                        break;
+                    }
+                }
+            }
+        }
+        fm.saveFile("books.csv");
+        for (auto &rename : renames)
+        {
+            if (uint64_t old = Isbn::pack(rename.first.first))
+                KeyFilters::removeIsbn(old, 1);
+            KeyFilters::addIsbn(Isbn::pack(rename.second));
+            AuditLog::record(memberId, "REPAIR_ISBN", rename.second, "was " + rename.first.first);
+        }
+
+        const char *related[] = {"transactions.csv", "reservations.csv"};
+        for (const char *filename : related)
+        {
+            if (renames.empty())
+                break;
+            fm.loadFile(filename);
+            for (auto &record : fm.getData())
+            {
+                for (auto &rename : renames)
+                {
+                    if (record[2] == rename.first.first && record[1] == rename.first.second)
+                        record[2] = rename.second;
+                }
             }
+            fm.saveFile(filename);
         }
+        if (!renames.empty())
+            cout << repaired << " book(s) repaired.\n";
     }
 
-private:
-    void showAvailableBooks()
+    void circulationTrends()
+    {
+        string from, to, period, by;
+        cout << "From (dd/mm/yyyy): ";
+        cin >> from;
+        cout << "To (dd/mm/yyyy): ";
+        cin >> to;
+        cout << "Per day or month (d/m): ";
+        cin >> period;
+        cout << "Break down by (none/type/publisher): ";
+        cin >> by;
+        if (by != "type" && by != "publisher")
+            by.clear();
+        CirculationRollups::printTrends(Dates::day(from), Dates::day(to),
+                                        period == "m", by, false);
+    }
+
+    void archiveLoans()
+    {
+        int days;
+        cout << "Archive closed loans borrowed more than how many days ago: ";
+        if (!(cin >> days) || days < 0)
+            throw runtime_error("Invalid number of days");
+        LoanArchive::run(days, memberId);
+    }
+
+    void viewReservations()
     {
+        FileManager fm(FileManager::pin());
+        vector<pair<size_t, vector<string>>> reservations;
+        for (size_t b = 0; b < Branches::count(); ++b)
+        {
+            fm.loadFile(Branches::pathIn(b, "reservations.csv"));
+            for (auto &res : fm.getData())
+                reservations.push_back(make_pair(b, res));
+        }
+
+        if (reservations.empty())
+        {
+            cout << "No active reservations.\n";
+            return;
+        }
+
+        cout << "\nActive Reservations:\n";
+        for (auto &entry : reservations)
+        {
+            const auto &res = entry.second;
+            time_t resDate = stol(res[3]);
+            tm *dt = localtime(&resDate);
+            cout << Branches::tag(entry.first) << "User: " << res[0]
+                 << " | Book: " << res[1]
+                 << " (ISBN: " << res[2] << ")"
+                 << " | Reserved: " << put_time(dt, "%d/%m/%Y %H:%M") << "\n";
+        }
+    }
+};
+
+class AuthService
+{
+public:
+    static LibraryMember *authenticate()
+    {
+        string userId, password;
+        cout << "User ID: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::UserId);
+            cin >> userId;
+        }
+        cout << "Password: ";
+        {
+            SessionRecorder::Scope field(SessionRecorder::Secret);
+            cin >> password;
+        }
+        if (!KeyFilters::mayHaveUser(userId))
+        {
+            AuditLog::record(userId, "LOGIN_FAILED", userId);
+            throw runtime_error("Authentication failed");
+        }
+
         FileManager fm;
-        fm.loadFile("books.csv");
-        cout << "\nAvailable Books:\n";
-        int count = 1;
-        for (auto &book : fm.getData())
+        fm.loadFile("users.csv");
+
+        for (auto &user : fm.getData())
         {
-            if (book[4] == "0")
+            if (user[1] == userId && user[2] == password)
             {
-                cout << count++ << ". " << book[0]
-                     << " by " << book[1] << " (ISBN: " << book[2] << ")\n";
+                AuditLog::record(userId, "LOGIN", userId, "type " + user[3]);
+                if (user[3] == "1")
+                    return new Student(user[1], user[0], user[2]);
+                if (user[3] == "2")
+                    return new Faculty(user[1], user[0], user[2]);
+                if (user[3] == "3")
+                    return new Librarian(user[1], user[0], user[2]);
             }
         }
+        AuditLog::record(userId, "LOGIN_FAILED", userId);
+        throw runtime_error("Authentication failed");
+    }
+};
+
+// Stands between the console and cin while the desk is recorded
+class ConsoleTap : public streambuf
+{
+private:
+    streambuf *in;
+    SessionRecorder::Tap tap;
+    string line;
+    char current;
+
+protected:
+    int underflow() override
+    {
+        int c = in->sbumpc();
+        if (c == traits_type::eof())
+        {
+            if (!line.empty())
+                tap.input(line);
+            line.clear();
+            return c;
+        }
+        current = (char)c;
+        setg(&current, &current, &current + 1);
+        line.push_back(current);
+        if (current == '\n')
+        {
+            tap.input(line);
+            line.clear();
+        }
+        return c;
+    }
+
+public:
+    explicit ConsoleTap(streambuf *input) : in(input)
+    {
+        SessionRecorder::begin(tap);
+        SessionRecorder::active() = &tap;
     }
 
-    void borrowBook()
-    {
-        FileManager fm;
-        fm.loadFile("transactions.csv");
-        int activeLoans = count_if(fm.getData().begin(), fm.getData().end(),
-                                   [this](const vector<string> &t)
-                                   { return t[0] == memberId && t[5] == "0"; });
+    ~ConsoleTap() { SessionRecorder::active() = nullptr; }
+};
 
-        if (activeLoans >= MAX_BORROW)
+// Asks which branch this desk serves; it stays current for the session
+bool chooseBranch()
+{
+    while (true)
+    {
+        cout << "\nBranches:\n";
+        for (size_t b = 0; b < Branches::count(); ++b)
+            cout << b + 1 << ". " << Branches::all()[b].name << "\n";
+        cout << "Branch: ";
+        int choice;
+        if (!LibraryMember::readChoice(choice))
+            return false;
+        if (choice >= 1 && (size_t)choice <= Branches::count())
         {
-            cout << "Maximum borrowing limit reached!\n";
-            return;
+            Branches::current() = choice - 1;
+            return true;
         }
+    }
+}
 
-        string isbn;
-        cout << "Enter ISBN: ";
-        cin >> isbn;
-
-        fm.loadFile("books.csv");
-        auto bookIt = find_if(fm.getData().begin(), fm.getData().end(),
-                              [&isbn](const vector<string> &b)
-                              { return b[2] == isbn && b[4] == "0"; });
+// The login loop of one terminal session, whether on the console or a kiosk
+void runFrontDesk()
+{
+    if (Branches::sharded() && !chooseBranch())
+        return;
 
-        if (bookIt != fm.getData().end())
+    while (true)
+    {
+        try
         {
-            (*bookIt)[4] = "1";
-            fm.saveFile("books.csv");
+            cout << "\nLibrary Management System";
+            if (Branches::sharded())
+                cout << " - " << Branches::all()[Branches::current()].name;
+            cout << "\n"
+                 << "1. Login\n2. Exit\nChoice: ";
+            int choice;
+            if (!LibraryMember::readChoice(choice))
+                break;
 
-            time_t dueDate = time(0) + LOAN_DAYS * 86400;
-            vector<string> transaction = {
-                memberId,
-                (*bookIt)[0],
-                isbn,
-                to_string(time(0)),
-                to_string(dueDate),
-                "0"};
-            fm.appendRecord(transaction, "transactions.csv");
-            cout << "Book borrowed successfully!\n";
+            if (choice == 1)
+            {
+                LibraryMember *user = AuthService::authenticate();
+                user->displayMainMenu();
+                delete user;
+            }
+            else if (choice == 2)
+            {
+                break;
+            }
         }
-        else
+        catch (const exception &e)
         {
-            cout << "Book not available!\n";
+            cerr << "System Error: " << e.what() << endl;
         }
     }
+}
 
-    void returnBook()
+// One kiosk connection. The session runs runFrontDesk() as a coroutine on
+// its own stack and is the stream buffer behind cin/cout while it runs:
+// reading with no input buffered suspends it back to the event loop.
+class KioskSession : public streambuf
+{
+public:
+    int fd;
+    ucontext_t context;
+    vector<char> stack;
+    string input;
+    string output;
+    bool peerClosed = false;
+    bool finished = false;
+    ios::iostate inState = ios::goodbit;
+    ios::fmtflags outFlags;
+    streamsize outPrecision;
+    size_t branch = 0;
+    SessionRecorder::Tap tap;
+
+    KioskSession(int socket, ucontext_t *scheduler, void (*entry)())
+        : fd(socket), stack(256 * 1024), outFlags(cout.flags()), outPrecision(cout.precision())
     {
-        string isbn;
-        cout << "Enter ISBN to return: ";
-        cin >> isbn;
+        SessionRecorder::begin(tap);
+        getcontext(&context);
+        context.uc_stack.ss_sp = stack.data();
+        context.uc_stack.ss_size = stack.size();
+        context.uc_link = scheduler;
+        makecontext(&context, entry, 0);
+    }
 
-        FileManager fm;
-        fm.loadFile("transactions.csv");
-        bool found = false;
+    static KioskSession *&current()
+    {
+        static KioskSession *session = nullptr;
+        return session;
+    }
+
+    static ucontext_t &scheduler()
+    {
+        static ucontext_t context;
+        return context;
+    }
 
-        for (auto &trans : fm.getData())
+protected:
+    // Input reaches cin a line at a time, so each line is read after the
+    // prompt it answers
+    int underflow() override
+    {
+        size_t end;
+        while ((end = input.find('\n')) == string::npos)
         {
-            if (trans[0] == memberId && trans[2] == isbn && trans[5] == "0")
+            if (peerClosed)
             {
-                trans[5] = "1";
-                found = true;
+                if (input.empty())
+                    return traits_type::eof();
+                end = input.size() - 1;
                 break;
             }
+            swapcontext(&context, &scheduler());
         }
+        pending.assign(input, 0, end + 1);
+        input.erase(0, end + 1);
+        tap.input(pending);
+        setg(&pending[0], &pending[0], &pending[0] + pending.size());
+        return traits_type::to_int_type(pending[0]);
+    }
 
-        if (found)
-        {
-            fm.saveFile("transactions.csv");
+    int overflow(int c) override
+    {
+        if (c != traits_type::eof())
+            output.push_back((char)c);
+        return c;
+    }
 
-            fm.loadFile("books.csv");
-            for (auto &book : fm.getData())
-            {
-                if (book[2] == isbn)
-                    book[4] = "0";
-            }
-            fm.saveFile("books.csv");
+    streamsize xsputn(const char *s, streamsize n) override
+    {
+        output.append(s, n);
+        return n;
+    }
 
-            cout << "Book returned successfully!\n";
+private:
+    string pending;
+};
+
+// Serves many line-oriented kiosk sessions from one thread over a local
+// Unix socket, multiplexed with epoll. Idle sessions cost a suspended
+// coroutine, not a thread, and all of them share this process's tables.
+class KioskServer
+{
+private:
+    string socketPath;
+    int listenFd = -1;
+    int epollFd = -1;
+    map<int, KioskSession *> sessions;
+
+    static volatile sig_atomic_t &stopping()
+    {
+        static volatile sig_atomic_t flag = 0;
+        return flag;
+    }
+
+    static void onSignal(int) { stopping() = 1; }
+
+    static void sessionMain()
+    {
+        try
+        {
+            runFrontDesk();
         }
-        else
+        catch (...)
         {
-            cout << "No active loan found for this book!\n";
         }
+        KioskSession::current()->finished = true;
     }
 
-    void reserveBook()
+    // Runs the session until it waits for input or ends, with cin, cout and
+    // cerr redirected to its socket
+    void resume(KioskSession *session)
     {
-        string isbn;
-        cout << "Enter ISBN to reserve: ";
-        cin >> isbn;
+        streambuf *in = cin.rdbuf(session);
+        streambuf *out = cout.rdbuf(session);
+        streambuf *err = cerr.rdbuf(session);
+        ios::fmtflags flags = cout.flags(session->outFlags);
+        streamsize precision = cout.precision(session->outPrecision);
+        cin.clear(session->inState);
 
-        FileManager fm;
-        fm.loadFile("books.csv");
-        auto bookIt = find_if(fm.getData().begin(), fm.getData().end(),
-                              [&isbn](const vector<string> &b)
-                              {
-                                  return b[2] == isbn && b[4] == "0" && b[5] == "0";
-                              });
+        KioskSession::current() = session;
+        SessionRecorder::active() = &session->tap;
+        size_t branch = Branches::current();
+        Branches::current() = session->branch;
+        swapcontext(&KioskSession::scheduler(), &session->context);
+        session->branch = Branches::current();
+        Branches::current() = branch;
+        SessionRecorder::active() = nullptr;
+        KioskSession::current() = nullptr;
 
-        if (bookIt != fm.getData().end())
-        {
-            (*bookIt)[5] = "1";
-            fm.saveFile("books.csv");
+        session->inState = cin.rdstate();
+        session->outFlags = cout.flags(flags);
+        session->outPrecision = cout.precision(precision);
+        cin.rdbuf(in);
+        cout.rdbuf(out);
+        cerr.rdbuf(err);
+        cin.clear();
 
-            vector<string> reservation = {
-                memberId,
-                (*bookIt)[0],
-                isbn,
-                to_string(time(0))};
-            fm.appendRecord(reservation, "reservations.csv");
-            cout << "Book reserved successfully!\n";
+        flush(session);
+    }
+
+    void flush(KioskSession *session)
+    {
+        while (!session->output.empty())
+        {
+            ssize_t sent = send(session->fd, session->output.data(), session->output.size(), MSG_NOSIGNAL);
+            if (sent <= 0)
+                break;
+            session->output.erase(0, sent);
         }
-        else
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        if (!session->output.empty())
+            ev.events |= EPOLLOUT;
+        ev.data.fd = session->fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, session->fd, &ev);
+    }
+
+    void acceptSessions()
+    {
+        while (true)
         {
-            cout << "Book not available for reservation!\n";
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+
+            epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = fd;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+
+            KioskSession *session = new KioskSession(fd, &KioskSession::scheduler(), &KioskServer::sessionMain);
+            sessions[fd] = session;
+            resume(session);
+            reap(session);
         }
     }
 
-    void showCurrentLoans()
+    void serve(KioskSession *session, uint32_t events)
     {
-        FileManager fm;
-        fm.loadFile("transactions.csv");
-        cout << "\nCurrent Loans:\n";
-        for (auto &trans : fm.getData())
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
         {
-            if (trans[0] == memberId && trans[5] == "0")
+            char buffer[4096];
+            while (true)
             {
-                time_t dueDate = stol(trans[4]);
-                tm *dt = localtime(&dueDate);
-                cout << "- " << trans[1] << " (ISBN: " << trans[2]
-                     << ") Due: " << put_time(dt, "%d/%m/%Y") << "\n";
+                ssize_t n = recv(session->fd, buffer, sizeof(buffer), 0);
+                if (n > 0)
+                    session->input.append(buffer, n);
+                else
+                {
+                    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                        session->peerClosed = true;
+                    break;
+                }
             }
         }
+
+        if (!session->finished && (!session->input.empty() || session->peerClosed))
+            resume(session);
+        else if (events & EPOLLOUT)
+            flush(session);
+        reap(session);
     }
-};
 
-class Librarian : public LibraryMember
-{
-public:
-    Librarian(const string &id, const string &name, const string &pwd)
+    void reap(KioskSession *session)
     {
-        memberId = id;
-        memberName = name;
-        memberPassword = pwd;
-        memberType = 3;
+        // A session ends once it has finished and its output is delivered,
+        // or the kiosk has hung up and the session has seen end of input
+        if (!session->finished || (!session->output.empty() && !session->peerClosed))
+            return;
+
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, session->fd, nullptr);
+        close(session->fd);
+        sessions.erase(session->fd);
+        delete session;
     }
 
-    void displayMainMenu() override
+public:
+    explicit KioskServer(const string &path) : socketPath(path) {}
+
+    void run()
     {
-        while (true)
-        {
-            cout << "\nLibrarian Portal - " << memberName << "\n"
-                 << "1. Add User\n"
-                 << "2. Update User\n"
-                 << "3. Remove User\n"
-                 << "4. Add Book\n"
-                 << "5. Update Book\n"
-                 << "6. Remove Book\n"
-                 << "7. View All Loans\n"
-                 << "8. View Reservations\n"
-                 << "9. Generate Reports\n"
-                 << "10. View User Loans\n"
-                 << "0. Logout\n"
-                 << "Choice: ";
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path))
+            throw runtime_error("Socket path too long: " + socketPath);
+        strcpy(addr.sun_path, socketPath.c_str());
 
-            int choice;
-            cin >> choice;
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        unlink(socketPath.c_str());
+        if (listenFd < 0 || ::bind(listenFd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, 64) < 0)
+            throw runtime_error("Cannot listen on " + socketPath + ": " + strerror(errno));
 
-            try
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = listenFd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+
+        struct sigaction sa = {};
+        sa.sa_handler = &KioskServer::onSignal;
+        sigaction(SIGINT, &sa, nullptr);
+        sigaction(SIGTERM, &sa, nullptr);
+        signal(SIGPIPE, SIG_IGN);
+
+        cout << "Kiosk server listening on " << socketPath << endl;
+        epoll_event events[64];
+        while (!stopping())
+        {
+            int n = epoll_wait(epollFd, events, 64, -1);
+            for (int i = 0; i < n; ++i)
             {
-                switch (choice)
+                if (events[i].data.fd == listenFd)
                 {
-                case 1:
-                    addUser();
-                    break;
-                case 2:
-                    updateUser();
-                    break;
-                case 3:
-                    removeUser();
-                    break;
-                case 4:
-                    addBook();
-                    break;
-                case 5:
-                    updateBook();
-                    break;
-                case 6:
-                    removeBook();
-                    break;
-                case 7:
-                    viewAllLoans();
-                    break;
-                case 8:
-                    viewReservations();
-                    break;
-                case 9:
-                    generateReports();
-                    break;
-                case 10:
-                    viewUserLoans();
-                    break;
-                case 0:
-                    return;
-                default:
-                    throw runtime_error("Invalid choice");
+                    acceptSessions();
+                    continue;
                 }
+                auto it = sessions.find(events[i].data.fd);
+                if (it != sessions.end())
+                    serve(it->second, events[i].events);
             }
-            catch (const exception &e)
-            {
-                cerr << "Error: " << e.what() << endl;
-                cin.clear();
-                // cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            }
         }
+
+        // Suspended coroutines are abandoned, not unwound, on shutdown
+        for (auto &entry : sessions)
+        {
+            close(entry.first);
+            delete entry.second;
+        }
+        sessions.clear();
+        close(epollFd);
+        close(listenFd);
+        unlink(socketPath.c_str());
+        cout << "Kiosk server stopped." << endl;
     }
+};
 
+// Load generator: replays recorded sessions against a kiosk server. Each of
+// N connections replays one recorded session (round robin), pacing its
+// inputs by the recorded offsets divided by the speed-up, and times each
+// input until the server's next prompt.
+class SessionReplayer
+{
 private:
-    void addUser()
+    struct Input
     {
-        vector<string> newUser(4);
-        cout << "Enter User Type (1-Student, 2-Faculty, 3-Librarian): ";
-        cin >> newUser[3];
-        cout << "Enter Name: ";
-        cin.ignore();
-        getline(cin, newUser[0]);
-        cout << "Enter User ID: ";
-        cin >> newUser[1];
-        cout << "Enter Password: ";
-        cin >> newUser[2];
+        long long offsetMs;
+        string field;
+        string value;
+    };
 
-        FileManager fm;
-        fm.appendRecord(newUser, "users.csv");
-        cout << "User added successfully!\n";
-    }
+    struct Outcome
+    {
+        vector<double> latencies;
+        size_t errors = 0;
+        size_t conflicts = 0;
+        size_t failedSessions = 0;
+    };
 
-    void updateUser()
+    vector<vector<Input>> sessions;
+    unordered_map<string, string> originals;
+    unordered_map<string, string> passwords;
+
+    void load(const string &path)
     {
-        string userId;
-        cout << "Enter User ID to update: ";
-        cin >> userId;
+        ifstream file(path);
+        if (!file)
+            throw runtime_error("Cannot open recording " + path);
 
+        map<pair<int, uint64_t>, vector<Input>> recorded;
+        int recording = 0;
+        string salt, line;
         FileManager fm;
         fm.loadFile("users.csv");
-        auto userIt = find_if(fm.getData().begin(), fm.getData().end(),
-                              [&userId](const vector<string> &u)
-                              { return u[1] == userId; });
+        auto users = fm.getData();
+        vector<vector<string>> books;
+        for (const string &catalogue : Branches::paths("books.csv"))
+        {
+            fm.loadFile(catalogue);
+            books.insert(books.end(), fm.getData().begin(), fm.getData().end());
+        }
+        for (auto &user : users)
+            passwords[user[1]] = user[2];
 
-        if (userIt != fm.getData().end())
+        while (getline(file, line))
         {
-            cout << "Select field to update:\n"
-                 << "1. Name\n2. Password\nChoice: ";
-            int field;
-            cin >> field;
+            if (line.compare(0, 10, "#recording") == 0)
+            {
+                recording++;
+                size_t at = line.find("salt=");
+                salt = at == string::npos ? "" : line.substr(at + 5);
+                // Pseudonyms are mapped back through the current data files
+                if (!salt.empty())
+                {
+                    for (auto &user : users)
+                    {
+                        originals[SessionRecorder::pseudonym(salt, "user", user[1])] = user[1];
+                        originals[SessionRecorder::pseudonym(salt, "name", user[0])] = user[0];
+                    }
+                    for (auto &book : books)
+                        originals[SessionRecorder::pseudonym(salt, "isbn", book[2])] = book[2];
+                }
+                continue;
+            }
 
-            cout << "Enter new value: ";
+            vector<string> fields;
+            stringstream ss(line);
+            string field;
+            while (fields.size() < 3 && getline(ss, field, '\t'))
+                fields.push_back(field);
+            if (fields.size() < 3)
+                continue;
             string value;
-            cin.ignore();
-            getline(cin, value);
+            getline(ss, value);
+            // Session numbers restart with each recording appended to the file
+            recorded[make_pair(recording, stoull(fields[0]))].push_back({stoll(fields[1]), fields[2], value});
+        }
+
+        for (auto &entry : recorded)
+            sessions.push_back(entry.second);
+        if (sessions.empty())
+            throw runtime_error("No sessions in " + path);
+    }
+
+    string resolve(const Input &input, string &user) const
+    {
+        if (input.field == "password")
+        {
+            auto it = passwords.find(user);
+            return it != passwords.end() ? it->second : input.value;
+        }
+        auto it = originals.find(input.value);
+        string value = it != originals.end() ? it->second : input.value;
+        if (input.field == "user")
+            user = value;
+        return value;
+    }
+
+    // Reads until the server shows a prompt or ends the session
+    static bool awaitPrompt(int fd, string &response)
+    {
+        response.clear();
+        char buffer[4096];
+        while (true)
+        {
+            pollfd p = {fd, POLLIN, 0};
+            if (poll(&p, 1, 10000) <= 0)
+                return false;
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+                return true;
+            response.append(buffer, n);
+            if (response.size() >= 2 && response.compare(response.size() - 2, 2, ": ") == 0)
+                return true;
+        }
+    }
+
+    void replay(const vector<Input> &inputs, const string &socketPath, double speedup, Outcome &outcome) const
+    {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        string response, user;
+        if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || !awaitPrompt(fd, response))
+        {
+            outcome.failedSessions++;
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
 
-            switch (field)
+        auto start = chrono::steady_clock::now();
+        for (const Input &input : inputs)
+        {
+            this_thread::sleep_until(start + chrono::microseconds((long long)(input.offsetMs * 1000 / speedup)));
+            string line = resolve(input, user) + "\n";
+            auto sent = chrono::steady_clock::now();
+            if (send(fd, line.data(), line.size(), MSG_NOSIGNAL) != (ssize_t)line.size() || !awaitPrompt(fd, response))
             {
-            case 1:
-                (*userIt)[0] = value;
-                break;
-            case 2:
-                (*userIt)[2] = value;
+                outcome.failedSessions++;
                 break;
-            default:
-                throw runtime_error("Invalid field");
             }
-            fm.saveFile("users.csv");
-            cout << "User updated successfully!\n";
+            outcome.latencies.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - sent).count());
+            if (response.find("Error") != string::npos || response.find("failed") != string::npos)
+                outcome.errors++;
+            else if (response.find("not available") != string::npos || response.find("No active loan") != string::npos)
+                outcome.conflicts++;
         }
-        else
+        close(fd);
+    }
+
+public:
+    explicit SessionReplayer(const string &recording) { load(recording); }
+
+    void run(const string &socketPath, size_t connections, double speedup)
+    {
+        if (speedup <= 0)
+            throw runtime_error("Speed-up must be positive");
+        vector<Outcome> outcomes(connections);
+        vector<thread> threads;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < connections; ++i)
+            threads.push_back(thread([&, i]()
+                                     { replay(sessions[i % sessions.size()], socketPath, speedup, outcomes[i]); }));
+        for (auto &worker : threads)
+            worker.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        Outcome total;
+        for (auto &outcome : outcomes)
         {
-            throw runtime_error("User not found");
+            total.latencies.insert(total.latencies.end(), outcome.latencies.begin(), outcome.latencies.end());
+            total.errors += outcome.errors;
+            total.conflicts += outcome.conflicts;
+            total.failedSessions += outcome.failedSessions;
         }
+        sort(total.latencies.begin(), total.latencies.end());
+        size_t requests = total.latencies.size();
+        auto percentile = [&](double p)
+        {
+            return requests ? total.latencies[min(requests - 1, (size_t)(p * requests))] : 0.0;
+        };
+
+        cout << fixed << setprecision(2)
+             << "Replayed " << connections << " session(s) from " << sessions.size() << " recorded, at "
+             << speedup << "x: " << requests << " inputs in " << seconds << " s ("
+             << (seconds > 0 ? requests / seconds : 0.0) << " inputs/s)\n"
+             << "Latency ms: p50 " << percentile(0.50) << ", p95 " << percentile(0.95)
+             << ", p99 " << percentile(0.99) << "\n"
+             << "Errors: " << total.errors << " (" << (requests ? 100.0 * total.errors / requests : 0.0)
+             << "%), conflicts: " << total.conflicts << " (" << (requests ? 100.0 * total.conflicts / requests : 0.0)
+             << "%), failed sessions: " << total.failedSessions << "\n";
     }
+};
 
-    void removeUser()
-    {
-        string userId;
-        cout << "Enter User ID to remove: ";
-        cin >> userId;
+// Tails a primary's mutation log from another process and applies it to
+// this process's tables, which then serve read-only queries
+class ReplicaTailer
+{
+private:
+    string logPath;
+    ino_t logFile = 0;
+    streamoff offset = 0;
+    thread worker;
+    atomic<bool> running;
+    atomic<uint64_t> appliedSeq;
+    atomic<long long> appliedTimestamp;
+    atomic<long long> bytesBehind;
+    atomic<long long> lastDelay;
 
-        FileManager fm;
+    // The primary's data directory: the one its log is in
+    string primaryDir() const
+    {
+        size_t slash = logPath.rfind('/');
+        return slash == string::npos ? "" : logPath.substr(0, slash + 1);
+    }
 
-        // Remove from users.csv
-        fm.loadFile("users.csv");
-        auto userIt = remove_if(fm.getData().begin(), fm.getData().end(),
-                                [&userId](const vector<string> &u)
-                                { return u[1] == userId; });
+    // Loads the primary's checkpoint next to its log, if it covers the
+    // log up to at least seq
+    bool loadCheckpoint(uint64_t seq)
+    {
+        map<string, TableVersion::Rows> tables;
+        uint64_t taken;
+        if (!Checkpoint::load(primaryDir() + "checkpoint.dat", tables, taken) || taken < seq)
+            return false;
+        FileManager::restore(tables);
+        appliedSeq = taken;
+        return true;
+    }
 
-        if (userIt != fm.getData().end())
+    // Applies every complete record past the current offset. A new log
+    // starts with a BASE record; when the replica has not applied
+    // everything before it, the tables come from the checkpoint instead.
+    void catchUp()
+    {
+        struct stat before, after;
+        if (stat(logPath.c_str(), &before) != 0)
+            return;
+        ifstream log(logPath);
+        if (!log || stat(logPath.c_str(), &after) != 0 || after.st_ino != before.st_ino)
+            return; // rotated while opening; try again next time
+        if (before.st_ino != logFile)
         {
-            fm.getData().erase(userIt, fm.getData().end());
-            fm.saveFile("users.csv");
-            cout << "User removed from registry.\n";
+            logFile = before.st_ino;
+            offset = 0;
+        }
 
-            // Handle related transactions
-            fm.loadFile("transactions.csv");
-            vector<string> booksToReturn;
-            for (auto &trans : fm.getData())
+        log.seekg(0, ios::end);
+        streamoff size = log.tellg();
+        log.seekg(offset);
+        string line;
+        while (getline(log, line) && !log.eof())
+        {
+            LogRecord rec;
+            if (LogRecord::decode(line, rec) && rec.seq > appliedSeq)
             {
-                if (trans[0] == userId && trans[5] == "0")
+                if (rec.op == "BASE")
                 {
-                    trans[5] = "1";
-                    booksToReturn.push_back(trans[2]);
+                    if (!loadCheckpoint(rec.seq))
+                        break; // the checkpoint is still being written
                 }
-            }
-            fm.saveFile("transactions.csv");
-
-            // Update book availability
-            if (!booksToReturn.empty())
-            {
-                fm.loadFile("books.csv");
-                for (auto &book : fm.getData())
+                else
                 {
-                    if (find(booksToReturn.begin(), booksToReturn.end(), book[2]) != booksToReturn.end())
-                    {
-                        book[4] = "0";
-                    }
+                    FileManager::applyLogged(rec);
+                    appliedSeq = rec.seq;
                 }
-                fm.saveFile("books.csv");
-                cout << "Associated books returned to inventory.\n";
+                appliedTimestamp = rec.timestamp;
+                lastDelay = MutationLog::nowMs() - rec.timestamp;
             }
-
-            // Remove reservations
-            fm.loadFile("reservations.csv");
-            fm.getData().erase(remove_if(fm.getData().begin(), fm.getData().end(),
-                                         [&userId](const vector<string> &r)
-                                         { return r[0] == userId; }),
-                               fm.getData().end());
-            fm.saveFile("reservations.csv");
-
-            cout << "User removed successfully!\n";
-        }
-        else
-        {
-            throw runtime_error("User not found!");
+            offset = log.tellg();
         }
+        bytesBehind = size - offset;
     }
 
-    void addBook()
-    {
-        vector<string> newBook(6);
-        cout << "Enter Book Title: ";
-        cin.ignore();
-        getline(cin, newBook[0]);
-        cout << "Enter Author: ";
-        getline(cin, newBook[1]);
-        cout << "Enter ISBN: ";
-        getline(cin, newBook[2]);
-        cout << "Enter Publisher: ";
-        getline(cin, newBook[3]);
-        newBook[4] = "0";
-        newBook[5] = "0";
+public:
+    explicit ReplicaTailer(const string &path)
+        : logPath(path), running(false), appliedSeq(0), appliedTimestamp(0), bytesBehind(0), lastDelay(0) {}
 
-        FileManager fm;
-        fm.appendRecord(newBook, "books.csv");
-        cout << "Book added successfully!\n";
+    void start()
+    {
+        FileManager::enterReplicaMode();
+        LoanArchive::directory() = primaryDir();
+        catchUp();
+        running = true;
+        worker = thread([this]()
+                        {
+            while (running)
+            {
+                this_thread::sleep_for(chrono::milliseconds(100));
+                catchUp();
+            } });
     }
 
-    void updateBook()
+    void stop()
     {
-        string isbn;
-        cout << "Enter ISBN to update: ";
-        cin >> isbn;
+        running = false;
+        if (worker.joinable())
+            worker.join();
+    }
 
-        FileManager fm;
-        fm.loadFile("books.csv");
-        auto bookIt = find_if(fm.getData().begin(), fm.getData().end(),
-                              [&isbn](const vector<string> &b)
-                              { return b[2] == isbn; });
+    uint64_t seq() const { return appliedSeq; }
+    long long behindBytes() const { return bytesBehind; }
 
-        if (bookIt != fm.getData().end())
-        {
-            cout << "Current Details:\n"
-                 << "1. Title: " << (*bookIt)[0] << "\n"
-                 << "2. Author: " << (*bookIt)[1] << "\n"
-                 << "3. Publisher: " << (*bookIt)[3] << "\n"
-                 << "Enter field number to update (1-3): ";
+    // Time between the primary writing the newest applied record and the
+    // replica applying it
+    long long lastDelayMs() const { return lastDelay; }
 
-            int field;
-            cin >> field;
-            cin.ignore();
+    // How stale the replica's view is: zero when it has applied everything
+    // the primary has written, otherwise the age of the newest applied record
+    long long lagMs() const
+    {
+        if (bytesBehind == 0)
+            return 0;
+        return appliedTimestamp == 0 ? -1 : MutationLog::nowMs() - appliedTimestamp;
+    }
+};
 
-            if (field < 1 || field > 3)
-            {
-                throw runtime_error("Invalid field selection");
-            }
+void runReplicaDesk(ReplicaTailer &tailer)
+{
+    while (true)
+    {
+        cout << "\nRead Replica - applied seq " << tailer.seq()
+             << ", lag " << tailer.lagMs() << " ms\n"
+             << "1. Generate Reports\n"
+             << "2. View All Loans\n"
+             << "3. View User Loans\n"
+             << "4. Search Catalogue\n"
+             << "5. Replication Status\n"
+             << "6. Export Snapshot\n"
+             << "7. Run Query\n"
+             << "0. Exit\n"
+             << "Choice: ";
 
-            cout << "Enter new value: ";
-            string value;
-            getline(cin, value);
+        int choice;
+        if (!LibraryMember::readChoice(choice))
+            return;
 
-            switch (field)
+        try
+        {
+            switch (choice)
             {
             case 1:
-                (*bookIt)[0] = value;
+                LibraryReports::generateReports();
                 break;
             case 2:
-                (*bookIt)[1] = value;
+                LibraryReports::viewAllLoans();
                 break;
             case 3:
-                (*bookIt)[3] = value;
+                LibraryReports::viewUserLoans();
                 break;
+            case 4:
+                LibraryReports::searchCatalogue();
+                break;
+            case 5:
+                cout << "\nApplied sequence: " << tailer.seq() << "\n"
+                     << "Bytes behind primary: " << tailer.behindBytes() << "\n"
+                     << "Lag: " << tailer.lagMs() << " ms\n"
+                     << "Last record applied " << tailer.lastDelayMs() << " ms after the primary wrote it\n";
+                break;
+            case 6:
+                LibraryReports::exportSnapshot();
+                break;
+            case 7:
+                QueryEngine::prompt();
+                break;
+            case 0:
+                return;
+            default:
+                throw runtime_error("Invalid choice");
             }
-
-            fm.saveFile("books.csv");
-
-            if (field == 1)
-            {
-                fm.loadFile("transactions.csv");
-                for (auto &trans : fm.getData())
-                {
-                    if (trans[2] == isbn)
-                    {
-                        trans[1] = value;
-                    }
-                }
-                fm.saveFile("transactions.csv");
-            }
-
-            cout << "Book updated successfully!\n";
         }
-        else
+        catch (const exception &e)
         {
-            throw runtime_error("Book not found!");
+            cerr << "Error: " << e.what() << endl;
         }
     }
+}
 
-    void removeBook()
+// Microbenchmark for the report scans: the old per-row string compares
+// against the packed columns and ColumnScan kernels, on synthetic tables
+void runScanBenchmark(size_t rows)
+{
+    TableVersion::Rows books, loans;
+    books.reserve(rows);
+    loans.reserve(rows);
+    time_t now = time(0);
+    srand(42);
+    for (size_t i = 0; i < rows; ++i)
     {
-        string isbn;
-        cout << "Enter ISBN to remove: ";
-        cin >> isbn;
+        books.push_back({"Title " + to_string(i), "Author", Isbn::format(9780000000000ULL + i), "Publisher",
+                         rand() % 3 ? "1" : "0", rand() % 10 ? "0" : "1"});
+        long issued = now - rand() % (90 * 86400);
+        loans.push_back({"STU" + to_string(i % 5000), "Title", Isbn::format(9780000000000ULL + i),
+                         to_string(issued), to_string(issued + 15 * 86400), rand() % 4 ? "1" : "0"});
+    }
+    auto bookTable = TableVersion::fromRows(books, nullptr);
+    auto loanTable = TableVersion::fromRows(loans, nullptr);
 
-        FileManager fm;
+    const int repeats = 20;
+    auto timeIt = [&](function<size_t()> fn, size_t &result)
+    {
+        auto start = chrono::steady_clock::now();
+        for (int r = 0; r < repeats; ++r)
+            result = fn();
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / repeats;
+    };
 
-        fm.loadFile("books.csv");
-        auto bookIt = remove_if(fm.getData().begin(), fm.getData().end(),
-                                [&isbn](const vector<string> &b)
-                                { return b[2] == isbn; });
+    auto start = chrono::steady_clock::now();
+    auto bookColumns = make_shared<const BookColumns>(*bookTable);
+    auto loanColumns = make_shared<const LoanColumns>(*loanTable);
+    double buildMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
 
-        if (bookIt != fm.getData().end())
-        {
-            fm.getData().erase(bookIt, fm.getData().end());
-            fm.saveFile("books.csv");
-            cout << "Book removed from catalog.\n";
+    size_t a = 0, b = 0;
+    cout << "Scan benchmark: " << rows << " books and loans, " << (ColumnScan::hasAvx2() ? "AVX2" : "scalar")
+         << " kernels, mean of " << repeats << " runs\n"
+         << "Column build (once per table version): " << fixed << setprecision(2) << buildMs << " ms\n";
 
-            fm.loadFile("transactions.csv");
-            fm.getData().erase(remove_if(fm.getData().begin(), fm.getData().end(),
-                                         [&isbn](const vector<string> &t)
-                                         { return t[2] == isbn; }),
-                               fm.getData().end());
-            fm.saveFile("transactions.csv");
+    auto report = [&](const string &name, double before, double after)
+    {
+        cout << left << setw(26) << name << right << setw(10) << setprecision(3) << before << " ms"
+             << setw(10) << after << " ms" << setw(9) << setprecision(1) << before / max(after, 1e-6) << "x"
+             << (a == b ? "" : "  MISMATCH") << "\n";
+    };
+    cout << left << setw(26) << "" << right << setw(13) << "strings" << setw(13) << "columns" << setw(10) << "speedup" << "\n";
 
-            fm.loadFile("reservations.csv");
-            fm.getData().erase(remove_if(fm.getData().begin(), fm.getData().end(),
-                                         [&isbn](const vector<string> &r)
-                                         { return r[2] == isbn; }),
-                               fm.getData().end());
-            fm.saveFile("reservations.csv");
+    double before = timeIt([&]()
+                           { return (size_t)count_if(books.begin(), books.end(), [](const vector<string> &r)
+                                                     { return r[4] == "0"; }); }, a);
+    double after = timeIt([&]()
+                          { return ColumnScan::popcount(bookColumns->available.data(), bookColumns->available.size()); }, b);
+    report("Count available books", before, after);
 
-            cout << "Associated records cleaned up.\n";
-        }
+    before = timeIt([&]()
+                    { return (size_t)count_if(loans.begin(), loans.end(), [](const vector<string> &r)
+                                              { return r[5] == "0"; }); }, a);
+    after = timeIt([&]()
+                   { return ColumnScan::popcount(loanColumns->active.data(), loanColumns->active.size()); }, b);
+    report("Count active loans", before, after);
+
+    before = timeIt([&]()
+                    { return (size_t)count_if(loans.begin(), loans.end(), [now](const vector<string> &r)
+                                              { return r[5] == "0" && stol(r[4]) < now; }); }, a);
+    after = timeIt([&]()
+                   {
+        vector<uint64_t> overdue = loanColumns->overdue(now);
+        return ColumnScan::popcount(overdue.data(), overdue.size()); }, b);
+    report("Count overdue loans", before, after);
+
+    vector<size_t> matches;
+    before = timeIt([&]()
+                    {
+        matches.clear();
+        for (size_t i = 0; i < loans.size(); ++i)
+            if (loans[i][5] == "0")
+                matches.push_back(i);
+        return matches.size(); }, a);
+    after = timeIt([&]()
+                   {
+        matches.clear();
+        ColumnScan::forEachSet(loanColumns->active.data(), loanColumns->active.size(), [&](size_t i)
+                               { matches.push_back(i); });
+        return matches.size(); }, b);
+    report("Filter active loans", before, after);
+}
+
+int main(int argc, char *argv[])
+{
+    // Recording applies to the desk and the kiosk server alike
+    string recordPath;
+    bool anonymise = false;
+    vector<char *> args;
+    for (int i = 0; i < argc; ++i)
+    {
+        if (string(argv[i]) == "--record" && i + 1 < argc)
+            recordPath = argv[++i];
+        else if (string(argv[i]) == "--anonymise")
+            anonymise = true;
         else
-        {
-            throw runtime_error("Book not found!");
-        }
+            args.push_back(argv[i]);
     }
+    argc = args.size();
+    argv = args.data();
 
-    void viewAllLoans()
+    if (argc == 2 && string(argv[1]) == "--verify-audit")
     {
-        FileManager fm;
-        fm.loadFile("transactions.csv");
-        cout << "\nAll Active Loans:\n";
-        for (auto &trans : fm.getData())
+        AuditLog::verify();
+        return 0;
+    }
+
+    if (argc >= 4 && string(argv[1]) == "--replay")
+    {
+        try
         {
-            if (trans[5] == "0")
-            {
-                time_t dueDate = stol(trans[4]);
-                tm *dt = localtime(&dueDate);
-                cout << "User: " << trans[0] << " | Book: " << trans[1]
-                     << " (ISBN: " << trans[2] << ") | Due: "
-                     << put_time(dt, "%d/%m/%Y") << "\n";
-            }
+            SessionReplayer(argv[2]).run(argv[3], argc >= 5 ? stoul(argv[4]) : 1, argc >= 6 ? stod(argv[5]) : 1.0);
+        }
+        catch (const exception &e)
+        {
+            cerr << "System Error: " << e.what() << endl;
+            return 1;
         }
+        return 0;
     }
 
-    void viewReservations()
+    if (argc >= 2 && string(argv[1]) == "--bench-scan")
     {
-        FileManager fm;
-        fm.loadFile("reservations.csv");
+        runScanBenchmark(argc >= 3 ? stoul(argv[2]) : 1000000);
+        return 0;
+    }
 
-        if (fm.getData().empty())
+    if (argc == 3 && string(argv[1]) == "--query")
+    {
+        try
         {
-            cout << "No active reservations.\n";
-            return;
+            QueryEngine::run(argv[2]);
         }
-
-        cout << "\nActive Reservations:\n";
-        for (auto &res : fm.getData())
+        catch (const exception &e)
         {
-            time_t resDate = stol(res[3]);
-            tm *dt = localtime(&resDate);
-            cout << "User: " << res[0]
-                 << " | Book: " << res[1]
-                 << " (ISBN: " << res[2] << ")"
-                 << " | Reserved: " << put_time(dt, "%d/%m/%Y %H:%M") << "\n";
+            cerr << "System Error: " << e.what() << endl;
+            return 1;
         }
+        return 0;
     }
 
-    void generateReports()
+    if (argc >= 4 && string(argv[1]) == "--trends")
     {
-        FileManager fm;
-
-        fm.loadFile("users.csv");
-        int totalUsers = fm.getData().size();
-
-        fm.loadFile("books.csv");
-        int totalBooks = fm.getData().size();
-        int availableBooks = count_if(fm.getData().begin(), fm.getData().end(),
-                                      [](const vector<string> &b)
-                                      { return b[4] == "0"; });
-
-        fm.loadFile("transactions.csv");
-        int activeLoans = count_if(fm.getData().begin(), fm.getData().end(),
-                                   [](const vector<string> &t)
-                                   { return t[5] == "0"; });
-
-        fm.loadFile("reservations.csv");
-        int activeReservations = fm.getData().size();
-
-        cout << "\n=== Library Status Report ===\n"
-             << "Total Users: " << totalUsers << "\n"
-             << "Total Books: " << totalBooks << "\n"
-             << "Available Books: " << availableBooks << "\n"
-             << "Active Loans: " << activeLoans << "\n"
-             << "Active Reservations: " << activeReservations << "\n";
-
-        float totalFines = 0.0;
-        time_t now = time(0);
-        for (auto &trans : fm.getData())
+        try
         {
-            if (trans[5] == "0")
-            {
-                time_t dueDate = stol(trans[4]);
-                int daysOverdue = (now - dueDate) / 86400;
-                if (daysOverdue > 0)
-                {
-                    totalFines += daysOverdue * 10.0;
-                }
-            }
+            string period = argc >= 5 ? argv[4] : "day";
+            string by = argc >= 6 ? argv[5] : "";
+            CirculationRollups::printTrends(Dates::day(argv[2]), Dates::day(argv[3]),
+                                            period == "month", by == "type" || by == "publisher" ? by : "", true);
         }
-        cout << "Estimated Outstanding Fines: ₹" << fixed << setprecision(2) << totalFines << "\n";
+        catch (const exception &e)
+        {
+            cerr << "System Error: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
     }
 
-    void viewUserLoans()
+    if (argc == 2 && string(argv[1]) == "--accrue-fines")
     {
-        string userId;
-        cout << "Enter User ID to view loans: ";
-        cin >> userId;
-
-        FileManager fm;
-        fm.loadFile("transactions.csv");
-
-        cout << "\nLoan History for User: " << userId << "\n";
-        for (auto &trans : fm.getData())
+        try
         {
-            if (trans[0] == userId)
-            {
-                time_t borrowDate = stol(trans[3]);
-                time_t dueDate = stol(trans[4]);
-                tm *bdt = localtime(&borrowDate);
-                tm *ddt = localtime(&dueDate);
-
-                cout << "- " << trans[1] << " (ISBN: " << trans[2] << ")\n"
-                     << "  Borrowed: " << put_time(bdt, "%d/%m/%Y")
-                     << " | Due: " << put_time(ddt, "%d/%m/%Y")
-                     << " | Status: " << (trans[5] == "0" ? "Active" : "Returned") << "\n";
-            }
+            FineLedger::runAccrual();
+        }
+        catch (const exception &e)
+        {
+            cerr << "System Error: " << e.what() << endl;
+            return 1;
         }
+        return 0;
     }
-};
 
-class AuthService
-{
-public:
-    static LibraryMember *authenticate()
+    if (argc == 3 && string(argv[1]) == "--replica")
     {
-        string userId, password;
-        cout << "User ID: ";
-        cin >> userId;
-        cout << "Password: ";
-        cin >> password;
+        ReplicaTailer tailer(argv[2]);
+        tailer.start();
+        runReplicaDesk(tailer);
+        tailer.stop();
+        return 0;
+    }
 
-        FileManager fm;
-        fm.loadFile("users.csv");
+    bool crashed;
+    try
+    {
+        crashed = Checkpoint::claim();
+    }
+    catch (const exception &e)
+    {
+        cerr << "System Error: " << e.what() << endl;
+        // Archiving rewrites transactions.csv behind a running desk's back,
+        // which would save over it with the loans it still holds
+        if (argc >= 2 && string(argv[1]) == "--archive-loans")
+            cerr << "--archive-loans runs offline only: stop it first, or use Archive Closed Loans from its menu\n";
+        return 1;
+    }
 
-        for (auto &user : fm.getData())
-        {
-            if (user[1] == userId && user[2] == password)
-            {
-                if (user[3] == "1")
-                    return new Student(user[1], user[0], user[2]);
-                if (user[3] == "2")
-                    return new Faculty(user[1], user[0], user[2]);
-                if (user[3] == "3")
-                    return new Librarian(user[1], user[0], user[2]);
-            }
-        }
-        throw runtime_error("Authentication failed");
+    try
+    {
+        MutationLog::open("mutations.log");
+        // A recovered run matches its log; the first checkpoint then starts
+        // a new one, dropping any save the crash cut short
+        if (!crashed || !Checkpoint::recover("mutations.log"))
+            Checkpoint::shipChanges();
+        KeyFilters::open();
+        CirculationRollups::open();
+        Checkpoint::start(60);
+        AuditLog::start();
+    }
+    catch (const exception &e)
+    {
+        cerr << "System Error: " << e.what() << endl;
+        return 1;
     }
-};
 
-int main()
-{
-    while (true)
+    int status = 0;
+    try
     {
-        try
+        if (argc >= 2 && string(argv[1]) == "--archive-loans")
         {
-            cout << "\nLibrary Management System\n"
-                 << "1. Login\n2. Exit\nChoice: ";
-            int choice;
-            cin >> choice;
-
-            if (choice == 1)
+            for (size_t b = 0; b < Branches::count(); ++b)
             {
-                LibraryMember *user = AuthService::authenticate();
-                user->displayMainMenu();
-                delete user;
-            }
-            else if (choice == 2)
-            {
-                break;
+                Branches::Scope scope(b);
+                LoanArchive::run(argc >= 3 ? stoi(argv[2]) : 0, "--archive-loans");
             }
         }
-        catch (const exception &e)
+        else
         {
-            cerr << "System Error: " << e.what() << endl;
+            CoBorrowIndex::ensureBuilt();
+            DueReminders::start();
+            if (!recordPath.empty())
+                SessionRecorder::open(recordPath, anonymise);
+
+            if (argc == 3 && string(argv[1]) == "--kiosk-server")
+                KioskServer(argv[2]).run();
+            else if (!recordPath.empty())
+            {
+                ConsoleTap tap(cin.rdbuf());
+                streambuf *in = cin.rdbuf(&tap);
+                runFrontDesk();
+                cin.rdbuf(in);
+            }
+            else
+                runFrontDesk();
         }
     }
-    return 0;
-}
\ No newline at end of file
+    catch (const exception &e)
+    {
+        cerr << "System Error: " << e.what() << endl;
+        status = 1;
+    }
+
+    DueReminders::stop();
+    AuditLog::stop();
+    Checkpoint::stop();
+    return status;
+}
@@ -0,0 +1,33 @@
+#!/bin/bash
+# A student whose loan is a few days overdue can still borrow; one whose
+# loan is past the policy's BlockAfterDays (15 for students) cannot.
+# Usage: tests/overdue_block.sh [path/to/library_system]
+set -u
+repo=$(cd "$(dirname "$0")/.." && pwd)
+bin=$(realpath "${1:-$repo/library_system}")
+[ -x "$bin" ] || { echo "Build first: g++ -std=c++11 -pthread lms.cpp -o library_system"; exit 2; }
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+fail() { echo "FAIL: $*"; exit 1; }
+
+# Borrows Design Patterns as STU001 while their other loan is the given
+# number of days overdue, and prints what the desk answered
+borrow()
+{
+    rm -rf "$work/data" && mkdir "$work/data"
+    cp "$repo"/{users,loan_policy}.csv "$work/data"
+    local due=$(($(date +%s) - $1 * 86400 - 3600))
+    cat > "$work/data/books.csv" <<CSV
+The C++ Programming Language,Bjarne Stroustrup,9780321563842,Addison-Wesley,1,0
+Design Patterns,Erich Gamma,9780201633610,Addison-Wesley,0,0
+CSV
+    echo "STU001,The C++ Programming Language,9780321563842,$((due - 15 * 86400)),$due,0" > "$work/data/transactions.csv"
+    : > "$work/data/reservations.csv"
+    (cd "$work/data" && printf '1\nSTU001\nstudent123\n3\n9780201633610\n8\n2\n' | "$bin" 2>&1)
+}
+
+borrow 10 | grep -q 'Book borrowed successfully' || fail "a student 10 days overdue could not borrow"
+borrow 15 | grep -q 'Book borrowed successfully' || fail "a student 15 days overdue could not borrow"
+borrow 16 | grep -q 'You have overdue books' || fail "a student 16 days overdue could borrow"
+echo "PASS: overdue blocking"